@@ -0,0 +1,672 @@
+// Microbenchmarks for the line store, parser and merge kernels.
+//
+// Build: gcc -O2 -pthread -o bench bench.c
+// Usage: bench [-n line_counts] [-l line_lengths] [-r repeats] [-d repeat_percent]
+//
+// client.c and server.c are single translation units, so they are included
+// here with their entry points and clashing names renamed. Every allocation
+// they make goes through the counting wrappers below. Each kernel runs over
+// synthetic lines with random, presorted, reversed and clustered line
+// numbers, and reports the best of the repeats in ns/line, allocations/line
+// and, where perf_event is available, cache misses/line. It also reports
+// the wire bytes it consumed, and the heap and resident memory it still
+// holds when it returns, per line.
+//
+// With -d, that share of lines repeats the text of an earlier line. The
+// "-i" kernels run with interning on; the server-side ones parse what a
+// client with -i sends back for the same lines.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+static unsigned long long bench_allocations = 0;
+static long long bench_heap_bytes = 0;      // live bytes allocated through the wrappers
+
+static void *count_allocation(void *pointer) {
+    __atomic_fetch_add(&bench_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bench_heap_bytes, (long long)malloc_usable_size(pointer), __ATOMIC_RELAXED);
+    return pointer;
+}
+
+static void *bench_malloc(size_t size) {
+    return count_allocation(malloc(size));
+}
+
+static void *bench_calloc(size_t count, size_t size) {
+    return count_allocation(calloc(count, size));
+}
+
+static void *bench_realloc(void *pointer, size_t size) {
+    __atomic_fetch_sub(&bench_heap_bytes, (long long)malloc_usable_size(pointer), __ATOMIC_RELAXED);
+    return count_allocation(realloc(pointer, size));
+}
+
+static char *bench_strdup(const char *text) {
+    return (char *)count_allocation(strdup(text));
+}
+
+static void bench_free(void *pointer) {
+    __atomic_fetch_sub(&bench_heap_bytes, (long long)malloc_usable_size(pointer), __ATOMIC_RELAXED);
+    free(pointer);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define strdup bench_strdup
+#define free bench_free
+
+#define main server_main
+#include "server.c"
+#undef main
+
+#define main client_main
+#define parse_arguments client_parse_arguments
+#define insert_line_node client_insert_line_node
+#define get_head client_get_head
+#define free_line_nodes client_free_line_nodes
+#define head client_head
+#define store_text client_store_text
+#define interning client_interning
+#define interned client_interned
+// line_node.h was already included by server.c, so redeclare the renamed list
+void insert_line_node(unsigned long long line_number, const char *line);
+line_node *get_head();
+void free_line_nodes();
+#include "client.c"
+#undef main
+#undef parse_arguments
+#undef insert_line_node
+#undef get_head
+#undef free_line_nodes
+#undef head
+#undef store_text
+#undef interning
+#undef interned
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef free
+
+#define MAX_SIZES 16
+#define INSERT_LINE_LIMIT 20000     // sorted-list insertion is quadratic
+
+typedef enum key_distribution {
+    KEYS_RANDOM,
+    KEYS_PRESORTED,
+    KEYS_REVERSED,
+    KEYS_CLUSTERED
+} key_distribution;
+
+static const char *distribution_names[] = { "random", "presorted", "reversed", "clustered" };
+
+typedef struct bench_input {
+    size_t count;
+    size_t line_length;
+    unsigned long long *numbers;    // line numbers in arrival order
+    char **texts;                   // repeated lines share their text
+    size_t *origins;                // first line with the same text
+    char *wire;                     // "<number> <text>\n" lines, NUL terminated
+    size_t wire_length;
+    char *interned_wire;            // the same lines as a client with -i sends them
+    size_t interned_wire_length;
+} bench_input;
+
+typedef struct bench_result {
+    double ns;
+    unsigned long long allocations;
+    long long cache_misses;         // -1 when perf_event is unavailable
+    size_t wire_bytes;              // input bytes the kernel consumed
+    long long heap_bytes;           // heap still held when the kernel returns
+    long long resident_bytes;       // resident set growth over the kernel
+} bench_result;
+
+static unsigned long long random_state = 88172645463325252ULL;
+
+static unsigned long long next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void shuffle(unsigned long long *values, size_t count) {
+    for (size_t i = count; i > 1; i--) {
+        size_t j = next_random() % i;
+        unsigned long long swap = values[i - 1];
+        values[i - 1] = values[j];
+        values[j] = swap;
+    }
+}
+
+// Formats the lines the way a client with -i sends them back, in arrival order.
+static void make_interned_wire(bench_input *input) {
+    client_interning = 1;
+    intern_table_init(&client_interned);
+    next_wire_id = 0;
+    store_data_in_sorted_list(input->wire, &sort_key);
+
+    // Line numbers are 0..count-1, so the sorted list indexes them
+    line_node **by_number = (line_node **)malloc(input->count * sizeof(line_node *));
+    for (line_node *current = client_head; current; current = current->next) {
+        by_number[current->line_number] = current;
+    }
+
+    // Back-references are never longer than the text they replace
+    input->interned_wire = (char *)malloc(input->wire_length + 1);
+    char *cursor = input->interned_wire;
+    for (size_t i = 0; i < input->count; i++) {
+        line_node *node = by_number[input->numbers[i]];
+        int send_text;
+        cursor += format_line_header(node, cursor, 48, &send_text);
+        if (send_text) {
+            memcpy(cursor, node->line, node->length);
+            cursor += node->length;
+        }
+        *cursor++ = '\n';
+    }
+    *cursor = '\0';
+    input->interned_wire_length = cursor - input->interned_wire;
+
+    free(by_number);
+    client_free_line_nodes();
+    client_head = NULL;
+    client_interning = 0;
+}
+
+static void make_input(bench_input *input, size_t count, size_t line_length, key_distribution distribution,
+                       int repeat_percent) {
+    input->count = count;
+    input->line_length = line_length;
+    input->numbers = (unsigned long long *)malloc(count * sizeof(unsigned long long));
+    input->texts = (char **)malloc(count * sizeof(char *));
+    input->origins = (size_t *)malloc(count * sizeof(size_t));
+
+    for (size_t i = 0; i < count; i++) {
+        input->numbers[i] = distribution == KEYS_REVERSED ? count - 1 - i : i;
+    }
+    if (distribution == KEYS_RANDOM) {
+        shuffle(input->numbers, count);
+    } else if (distribution == KEYS_CLUSTERED) {
+        // Shuffled within blocks of 64, blocks in order
+        for (size_t start = 0; start < count; start += 64) {
+            shuffle(input->numbers + start, count - start < 64 ? count - start : 64);
+        }
+    }
+
+    input->wire = (char *)malloc(count * (line_length + 24) + 1);
+    char *cursor = input->wire;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && (int)(next_random() % 100) < repeat_percent) {
+            input->origins[i] = input->origins[next_random() % i];
+            input->texts[i] = input->texts[input->origins[i]];
+        } else {
+            input->origins[i] = i;
+            input->texts[i] = (char *)malloc(line_length + 1);
+            for (size_t j = 0; j < line_length; j++) {
+                input->texts[i][j] = 'a' + next_random() % 26;
+            }
+            input->texts[i][line_length] = '\0';
+        }
+        cursor += sprintf(cursor, "%llu %s\n", input->numbers[i], input->texts[i]);
+    }
+    input->wire_length = cursor - input->wire;
+    make_interned_wire(input);
+}
+
+static void free_input(bench_input *input) {
+    for (size_t i = 0; i < input->count; i++) {
+        if (input->origins[i] == i) {
+            free(input->texts[i]);
+        }
+    }
+    free(input->origins);
+    free(input->texts);
+    free(input->numbers);
+    free(input->wire);
+    free(input->interned_wire);
+}
+
+static line_node *make_node(unsigned long long number, const char *text, size_t length) {
+    line_node *node = (line_node *)malloc(sizeof(line_node));
+    node->line_number = number;
+    node->line = (char *)malloc(length + 1);
+    memcpy(node->line, text, length + 1);
+    node->length = length;
+    node->key = sort_key_normalize(&sort_key, node);
+    node->next = NULL;
+    return node;
+}
+
+static void free_list(line_node *list) {
+    while (list) {
+        line_node *next = list->next;
+        free(list->line);
+        free(list);
+        list = next;
+    }
+}
+
+static int cache_counter = -1;
+
+static void open_cache_counter(void) {
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    cache_counter = (int)syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+static long long resident_bytes(void) {
+    long long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%lld %lld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+typedef struct bench_timer {
+    struct timespec start;
+    unsigned long long allocations;
+    long long heap_bytes;
+    long long resident_bytes;
+} bench_timer;
+
+static void timer_start(bench_timer *timer) {
+    // Hand freed memory back first so resident growth is the kernel's own
+    malloc_trim(0);
+    timer->heap_bytes = bench_heap_bytes;
+    timer->resident_bytes = resident_bytes();
+    if (cache_counter >= 0) {
+        ioctl(cache_counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cache_counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    timer->allocations = bench_allocations;
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+static bench_result timer_stop(const bench_timer *timer) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    bench_result result;
+    result.ns = (end.tv_sec - timer->start.tv_sec) * 1e9 + (end.tv_nsec - timer->start.tv_nsec);
+    result.allocations = bench_allocations - timer->allocations;
+    result.cache_misses = -1;
+    result.wire_bytes = 0;
+    result.heap_bytes = bench_heap_bytes - timer->heap_bytes;
+    result.resident_bytes = resident_bytes() - timer->resident_bytes;
+    if (cache_counter >= 0) {
+        ioctl(cache_counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(cache_counter, &result.cache_misses, sizeof(result.cache_misses)) != sizeof(result.cache_misses)) {
+            result.cache_misses = -1;
+        }
+    }
+    return result;
+}
+
+// Baseline: one sorted-list insertion per line.
+static bench_result bench_insert_line_node(const bench_input *input) {
+    bench_timer timer;
+    timer_start(&timer);
+    for (size_t i = 0; i < input->count; i++) {
+        insert_line_node(input->numbers[i], input->texts[i]);
+    }
+    bench_result result = timer_stop(&timer);
+    free_line_nodes();
+    head = NULL;
+    return result;
+}
+
+// Replacement: batch radix sort of the same lines.
+static bench_result bench_sort_line_nodes(const bench_input *input) {
+    line_node **nodes = (line_node **)malloc(input->count * sizeof(line_node *));
+    for (size_t i = 0; i < input->count; i++) {
+        nodes[i] = make_node(input->numbers[i], input->texts[i], input->line_length);
+    }
+    bench_timer timer;
+    timer_start(&timer);
+    line_node *sorted = sort_line_nodes(&sort_key, nodes, input->count);
+    bench_result result = timer_stop(&timer);
+    free_list(sorted);
+    free(nodes);
+    return result;
+}
+
+// Byte-wise text key over lines that differ only in their last 8 bytes,
+// so every chunk before that is shared: the MSD pass's longest descent.
+static bench_result bench_sort_shared_prefix(const bench_input *input) {
+    sort_key_spec text_key;
+    parse_sort_key_spec("text", &text_key);
+    size_t shared = input->line_length > SORT_KEY_CHUNK_SIZE ? input->line_length - SORT_KEY_CHUNK_SIZE : 0;
+    char *text = (char *)malloc(input->line_length + 1);
+    memset(text, 'p', shared);
+
+    line_node **nodes = (line_node **)malloc(input->count * sizeof(line_node *));
+    for (size_t i = 0; i < input->count; i++) {
+        memcpy(text + shared, input->texts[i] + shared, input->line_length - shared + 1);
+        nodes[i] = make_node(input->numbers[i], text, input->line_length);
+        nodes[i]->key = sort_key_normalize(&text_key, nodes[i]);
+    }
+    bench_timer timer;
+    timer_start(&timer);
+    line_node *sorted = sort_line_nodes(&text_key, nodes, input->count);
+    bench_result result = timer_stop(&timer);
+    free_list(sorted);
+    free(nodes);
+    free(text);
+    return result;
+}
+
+static bench_result run_parse_line(const bench_input *input, const char *input_wire, size_t wire_length) {
+    char *wire = (char *)malloc(wire_length + 1);
+    memcpy(wire, input_wire, wire_length + 1);
+    char **texts = (char **)malloc(input->count * sizeof(char *));
+    size_t *lengths = (size_t *)malloc(input->count * sizeof(size_t));
+    client_info client;
+    memset(&client, 0, sizeof(client));
+
+    bench_timer timer;
+    timer_start(&timer);
+    char *line = wire;
+    for (size_t i = 0; i < input->count; i++) {
+        char *line_end = strchr(line, '\n');
+        *line_end = '\0';
+        unsigned long long number;
+        parse_line(&client, line, line_end - line, &number, &texts[i], &lengths[i]);
+        line = line_end + 1;
+    }
+    bench_result result = timer_stop(&timer);
+    result.wire_bytes = wire_length;
+
+    for (size_t i = 0; i < input->count; i++) {
+        release_text(&client, texts[i], lengths[i]);
+    }
+    release_dictionary(&client);
+    held_bytes = 0;
+    free(lengths);
+    free(texts);
+    free(wire);
+    return result;
+}
+
+static bench_result run_process_client_data(const char *input_wire, size_t wire_length) {
+    char *wire = (char *)malloc(wire_length + 1);
+    memcpy(wire, input_wire, wire_length + 1);
+    client_info client;
+    memset(&client, 0, sizeof(client));
+
+    bench_timer timer;
+    timer_start(&timer);
+    process_client_data(&client, wire, wire_length, 1);
+    bench_result result = timer_stop(&timer);
+    result.wire_bytes = wire_length;
+
+    for (size_t i = 0; i < client.run_length; i++) {
+        release_text(&client, client.run[i]->line, client.run[i]->length);
+        free(client.run[i]);
+    }
+    release_dictionary(&client);
+    held_bytes = 0;
+    free(client.run);
+    free(wire);
+    return result;
+}
+
+static bench_result bench_parse_line(const bench_input *input) {
+    return run_parse_line(input, input->wire, input->wire_length);
+}
+
+static bench_result bench_parse_line_interned(const bench_input *input) {
+    interning = 1;
+    intern_table_init(&interned);
+    bench_result result = run_parse_line(input, input->interned_wire, input->interned_wire_length);
+    intern_table_free(&interned);
+    interning = 0;
+    return result;
+}
+
+static bench_result bench_process_client_data(const bench_input *input) {
+    return run_process_client_data(input->wire, input->wire_length);
+}
+
+static bench_result bench_process_client_data_interned(const bench_input *input) {
+    interning = 1;
+    intern_table_init(&interned);
+    bench_result result = run_process_client_data(input->interned_wire, input->interned_wire_length);
+    intern_table_free(&interned);
+    interning = 0;
+    return result;
+}
+
+static bench_result bench_store_data_in_sorted_list(const bench_input *input) {
+    bench_timer timer;
+    timer_start(&timer);
+    store_data_in_sorted_list(input->wire, &sort_key);
+    bench_result result = timer_stop(&timer);
+    result.wire_bytes = input->wire_length;
+    free_list(client_head);
+    client_head = NULL;
+    return result;
+}
+
+static bench_result bench_store_data_in_sorted_list_interned(const bench_input *input) {
+    client_interning = 1;
+    intern_table_init(&client_interned);
+    bench_timer timer;
+    timer_start(&timer);
+    store_data_in_sorted_list(input->wire, &sort_key);
+    bench_result result = timer_stop(&timer);
+    result.wire_bytes = input->wire_length;
+    client_free_line_nodes();
+    client_head = NULL;
+    client_interning = 0;
+    return result;
+}
+
+static bench_result bench_read_fragment_data(const bench_input *input) {
+    FILE *fragment = tmpfile();
+    fwrite(input->wire, 1, input->wire_length, fragment);
+    rewind(fragment);
+    char *buffer = (char *)malloc(WRITE_BUFFER_SIZE);
+
+    bench_timer timer;
+    timer_start(&timer);
+    while (read_fragment_data(fragment, buffer, WRITE_BUFFER_SIZE) > 0) {
+    }
+    bench_result result = timer_stop(&timer);
+
+    free(buffer);
+    fclose(fragment);
+    return result;
+}
+
+// Final parallel merge and write of four interleaved sorted runs.
+static bench_result bench_write_output(const bench_input *input) {
+    const size_t num_inputs = 4;
+    line_node **all = (line_node **)malloc(input->count * sizeof(line_node *));
+    for (size_t r = 0; r < num_inputs; r++) {
+        size_t begin = input->count * r / num_inputs, end = input->count * (r + 1) / num_inputs;
+        line_node **nodes = (line_node **)malloc((end - begin + 1) * sizeof(line_node *));
+        for (size_t i = begin; i < end; i++) {
+            nodes[i - begin] = all[i] = make_node(input->numbers[i], input->texts[i], input->line_length);
+        }
+        sort_line_nodes(&sort_key, nodes, end - begin);
+        add_sorted_run(nodes, end - begin, 0, 0);
+    }
+
+    char path[] = "/tmp/bench_output_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    bench_timer timer;
+    timer_start(&timer);
+    write_output(path);
+    bench_result result = timer_stop(&timer);
+
+    unlink(path);
+    for (size_t r = 0; r < num_runs; r++) {
+        free(runs[r].nodes);
+    }
+    num_runs = 0;
+    for (size_t i = 0; i < input->count; i++) {
+        free(all[i]->line);
+        free(all[i]);
+    }
+    free(all);
+    return result;
+}
+
+typedef struct bench_kernel {
+    const char *name;
+    bench_result (*run)(const bench_input *input);
+    size_t max_lines;
+} bench_kernel;
+
+static const bench_kernel kernels[] = {
+    { "insert_line_node", bench_insert_line_node, INSERT_LINE_LIMIT },
+    { "sort_line_nodes", bench_sort_line_nodes, 0 },
+    { "sort_shared_prefix", bench_sort_shared_prefix, 0 },
+    { "parse_line", bench_parse_line, 0 },
+    { "parse_line -i", bench_parse_line_interned, 0 },
+    { "process_client_data", bench_process_client_data, 0 },
+    { "process_client_data -i", bench_process_client_data_interned, 0 },
+    { "store_data_in_sorted_list", bench_store_data_in_sorted_list, 0 },
+    { "store_data_in_sorted_list -i", bench_store_data_in_sorted_list_interned, 0 },
+    { "read_fragment_data", bench_read_fragment_data, 0 },
+    { "write_output", bench_write_output, 0 },
+};
+
+static int parse_list(const char *text, size_t *values) {
+    int count = 0;
+    while (*text && count < MAX_SIZES) {
+        size_t length = strcspn(text, ",");
+        char item[32];
+        snprintf(item, sizeof(item), "%.*s", (int)length, text);
+        values[count] = parse_size(item);
+        if (values[count] == 0) {
+            return -1;
+        }
+        count++;
+        text += length;
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    size_t line_counts[MAX_SIZES] = { 1000, 100000 };
+    size_t line_lengths[MAX_SIZES] = { 16, 200 };
+    int num_counts = 2, num_lengths = 2, repeats = 3, repeat_percent = 0;
+
+    int option;
+    int valid = 1;
+    while ((option = getopt(argc, argv, "n:l:r:d:")) != -1) {
+        switch (option) {
+        case 'n':
+            num_counts = parse_list(optarg, line_counts);
+            valid = valid && num_counts > 0;
+            break;
+        case 'l':
+            num_lengths = parse_list(optarg, line_lengths);
+            valid = valid && num_lengths > 0;
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            valid = valid && repeats > 0;
+            break;
+        case 'd':
+            repeat_percent = atoi(optarg);
+            valid = valid && repeat_percent >= 0 && repeat_percent <= 100;
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+    }
+    if (!valid || optind != argc) {
+        fprintf(stderr, "Usage: %s [-n line_counts] [-l line_lengths] [-r repeats] [-d repeat_percent]\n", argv[0]);
+        return 1;
+    }
+
+    default_sort_key_spec(&sort_key);
+    output_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    open_cache_counter();
+    if (cache_counter < 0) {
+        printf("perf_event unavailable: cache misses not reported\n");
+    }
+
+    // Streamed and summary output from the kernels would swamp the table
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    printf("%-29s %-10s %9s %6s %10s %11s %13s %10s %10s %10s\n", "kernel", "keys", "lines", "length",
+           "ns/line", "allocs/line", "misses/line", "wire/line", "heap/line", "rss/line");
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        for (int c = 0; c < num_counts; c++) {
+            if (kernels[k].max_lines && line_counts[c] > kernels[k].max_lines) {
+                continue;
+            }
+            for (int l = 0; l < num_lengths; l++) {
+                for (int d = KEYS_RANDOM; d <= KEYS_CLUSTERED; d++) {
+                    bench_input input;
+                    make_input(&input, line_counts[c], line_lengths[l], (key_distribution)d, repeat_percent);
+
+                    bench_result best = { 0, 0, -1, 0, 0, 0 };
+                    for (int r = 0; r < repeats; r++) {
+                        fflush(stdout);
+                        dup2(null_fd, STDOUT_FILENO);
+                        bench_result result = kernels[k].run(&input);
+                        fflush(stdout);
+                        dup2(saved_stdout, STDOUT_FILENO);
+                        if (r == 0 || result.ns < best.ns) {
+                            best = result;
+                        }
+                    }
+
+                    double lines = (double)input.count;
+                    printf("%-29s %-10s %9zu %6zu %10.1f %11.2f ", kernels[k].name, distribution_names[d],
+                           input.count, input.line_length, best.ns / lines, best.allocations / lines);
+                    if (best.cache_misses >= 0) {
+                        printf("%13.2f ", best.cache_misses / lines);
+                    } else {
+                        printf("%13s ", "n/a");
+                    }
+                    printf("%10.1f %10.1f %10.1f\n", best.wire_bytes / lines, best.heap_bytes / lines,
+                           best.resident_bytes / lines);
+                    free_input(&input);
+                }
+            }
+        }
+    }
+
+    close(null_fd);
+    close(saved_stdout);
+    return 0;
+}
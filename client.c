@@ -7,38 +7,55 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include "line_node.h"
+#include "sort_key.h"
+#include "intern_table.h"
 
 typedef struct client_args {
     char *address;
     int port;
+    sort_key_spec sort_key;
+    int interning;
 } client_args;
 
-typedef struct line_node {
-    int line_number;
-    char *line;
-    struct line_node *next;
-} line_node;
-
-void insert_line_node(int line_number, const char *line);
-line_node *get_head();
-void free_line_nodes();
 client_args parse_arguments(int argc, char *argv[]);
 int create_socket_and_connect(const char *address, int port);
+long long measure_throughput(const sort_key_spec *sort_key);
+void send_capabilities(int socket_fd, const sort_key_spec *sort_key);
 char *read_data_from_server(int socket_fd);
-void store_data_in_sorted_list(const char *received_data);
+void store_data_in_sorted_list(const char *received_data, const sort_key_spec *sort_key);
+char *store_text(const char *text, size_t length);
+int format_line_header(const line_node *node, char *header, size_t header_size, int *send_text);
 void send_sorted_data_to_server(int socket_fd, line_node *head);
+void write_all(int socket_fd, const char *data, size_t length);
 void cleanup_and_exit(int socket_fd, line_node *head);
 
+#define READ_CHUNK_SIZE 65536
+#define SEND_BUFFER_SIZE 65536
+#define CALIBRATION_LINES 65536
+
 static line_node *head = NULL;
+static int interning = 0;           // repeated line texts stored and sent once
+static intern_table interned;
+static long next_wire_id = 0;
 
 int main(int argc, char *argv[]) {
     client_args args = parse_arguments(argc, argv);
+    interning = args.interning;
+    if (interning) {
+        intern_table_init(&interned);
+    }
     printf("Connecting to %s:%d\n", args.address, args.port);
     int socket_fd = create_socket_and_connect(args.address, args.port);
     printf("Connected\n");
+    send_capabilities(socket_fd, &args.sort_key);
     char *received_data = read_data_from_server(socket_fd);
-    printf("Received data:\n%s\n", received_data);
-    store_data_in_sorted_list(received_data);
+    #ifdef DEBUG
+        printf("Received data:\n%s\n", received_data);
+    #endif
+    store_data_in_sorted_list(received_data, &args.sort_key);
+    free(received_data);
     printf("Sorted data:\n");
     line_node *head = get_head();
     printf("Sending sorted data to server\n");
@@ -50,10 +67,12 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
-void insert_line_node(int line_number, const char *line) {
+void insert_line_node(unsigned long long line_number, const char *line) {
     line_node *new_node = (line_node *)malloc(sizeof(line_node));
     new_node->line_number = line_number;
-    new_node->line = strdup(line);
+    new_node->length = strlen(line);
+    new_node->line = store_text(line, new_node->length);
+    new_node->key = line_number;
     new_node->next = NULL;
 
     if (!head || line_number < head->line_number) {
@@ -77,21 +96,39 @@ void free_line_nodes() {
     line_node *current = head;
     while (current) {
         line_node *next = current->next;
-        free(current->line);
+        if (!interning) {
+            free(current->line);
+        }
         free(current);
         current = next;
     }
+    if (interning) {
+        intern_table_free(&interned);
+    }
 }
 
 client_args parse_arguments(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <address> <port>\n", argv[0]);
+    client_args args;
+    default_sort_key_spec(&args.sort_key);
+    args.interning = 0;
+
+    int option;
+    int valid = 1;
+    while ((option = getopt(argc, argv, "k:i")) != -1) {
+        if (option == 'i') {
+            args.interning = 1;
+        } else if (option != 'k' || parse_sort_key_spec(optarg, &args.sort_key) != 0) {
+            valid = 0;
+        }
+    }
+
+    if (!valid || argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-k sort_key] [-i] <address> <port>\n", argv[0]);
         exit(1);
     }
 
-    client_args args;
-    args.address = argv[1];
-    args.port = atoi(argv[2]);
+    args.address = argv[optind];
+    args.port = atoi(argv[optind + 1]);
     return args;
 }
 
@@ -124,67 +161,222 @@ int create_socket_and_connect(const char *address, int port) {
     return socket_fd;
 }
 
+// Times a sort of synthetic lines with the job's key to estimate how many
+// lines per second this machine can sort right now.
+long long measure_throughput(const sort_key_spec *sort_key) {
+    line_node *nodes = (line_node *)malloc(sizeof(line_node) * CALIBRATION_LINES);
+    line_node **order = (line_node **)malloc(sizeof(line_node *) * CALIBRATION_LINES);
+    char *text = (char *)malloc(CALIBRATION_LINES * 16);
+    unsigned long long state = 88172645463325252ULL;
+
+    for (int i = 0; i < CALIBRATION_LINES; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        nodes[i].line_number = state >> 24;
+        nodes[i].line = text + i * 16;
+        nodes[i].length = snprintf(nodes[i].line, 16, "%llu", state % 1000000000000ULL);
+        nodes[i].key = sort_key_normalize(sort_key, &nodes[i]);
+        order[i] = &nodes[i];
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sort_line_nodes(sort_key, order, CALIBRATION_LINES);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    free(text);
+    free(order);
+    free(nodes);
+    return elapsed > 0 ? (long long)(CALIBRATION_LINES / elapsed) : 0;
+}
+
+// Reports cores, memory and sort throughput so the server can give larger
+// fragments to more capable clients.
+void send_capabilities(int socket_fd, const sort_key_spec *sort_key) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long long memory_mb = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+    long long throughput = measure_throughput(sort_key);
+
+    char hello[128];
+    int length = snprintf(hello, sizeof(hello), "HELLO %ld %lld %lld\n", cores, memory_mb, throughput);
+    printf("Capabilities: %ld cores, %lld MB, %lld lines/s\n", cores, memory_mb, throughput);
+    write_all(socket_fd, hello, length);
+}
+
 char *read_data_from_server(int socket_fd) {
-    const int buffer_size = 1024;
     char *data = NULL;
     size_t data_size = 0;
+    size_t capacity = 0;
     ssize_t bytes_read;
-    char buffer[buffer_size];
 
     printf("Reading data from server\n");
 
+    // Grow geometrically so arbitrarily long fragments cost amortized O(n)
     do {
-        bytes_read = read(socket_fd, buffer, buffer_size - 1);
-        printf("Read %ld bytes\n", bytes_read);
-        buffer[bytes_read] = '\0';
-        data = realloc(data, data_size + bytes_read + 1);
-        strncpy(data + data_size, buffer, bytes_read + 1);
+        if (capacity - data_size < READ_CHUNK_SIZE) {
+            capacity = capacity ? capacity * 2 : READ_CHUNK_SIZE;
+            data = realloc(data, capacity + 1);
+        }
+        bytes_read = read(socket_fd, data + data_size, capacity - data_size);
+        if (bytes_read < 0) {
+            perror("Error reading from server");
+            exit(5);
+        }
         data_size += bytes_read;
-    } while (buffer[bytes_read - 1] != '\0');
+    } while (bytes_read > 0 && data[data_size - 1] != '\0');
+
+    data[data_size] = '\0';
+    printf("Read %zu bytes\n", data_size);
+    return data;
+}
 
-    if (bytes_read < 0) {
-        perror("Error reading from server");
-        exit(5);
+void store_data_in_sorted_list(const char *received_data, const sort_key_spec *sort_key) {
+    const char *line = received_data;
+    line_node **nodes = NULL;
+    size_t count = 0, capacity = 0;
+
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        size_t line_length = end ? (size_t)(end - line) : strlen(line);
+        if (line_length == 0) {
+            line++;
+            continue;
+        }
+
+        char *text_start;
+        unsigned long long line_number = strtoull(line, &text_start, 10);
+        if (text_start > line + line_length) {
+            text_start = (char *)line + line_length;
+        }
+        if (text_start < line + line_length && *text_start == ' ') {
+            text_start++;
+        }
+        size_t text_length = line_length - (text_start - line);
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            nodes = (line_node **)realloc(nodes, capacity * sizeof(line_node *));
+        }
+        line_node *new_node = (line_node *)malloc(sizeof(line_node));
+        new_node->line_number = line_number;
+        new_node->line = store_text(text_start, text_length);
+        new_node->length = text_length;
+        new_node->key = sort_key_normalize(sort_key, new_node);
+        nodes[count++] = new_node;
+
+        line += line_length;
+        if (*line == '\n') {
+            line++;
+        }
     }
 
-    return data;
+    // Batch radix sort instead of one sorted-list insertion per line
+    line_node *sorted = sort_line_nodes(sort_key, nodes, count);
+    head = merge_line_nodes(sort_key, head, sorted);
+
+    free(nodes);
 }
 
-void store_data_in_sorted_list(const char *received_data) {
-    const char *delimiter = "\n";
-    char *data = strdup(received_data);
-    char *line = strtok(data, delimiter);
-    int line_number;
+// Returns a copy of text for a new line; with interning, repeated texts
+// share one copy.
+char *store_text(const char *text, size_t length) {
+    if (interning) {
+        int added;
+        return intern_text(&interned, text, length, &added);
+    }
+    char *copy = (char *)malloc(length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
 
-    while (line) {
-        sscanf(line, "%d", &line_number);
-        char *text_start = strchr(line, ' ') + 1;
-        insert_line_node(line_number, text_start);
-        line = strtok(NULL, delimiter);
+// Formats what precedes a line's text on the wire and returns its length.
+// With interning, a text repeated in the fragment goes out once as
+// "<n>+<text>", defining the next back-reference id, and after that as
+// "<n>*<id>" wherever the id is shorter than the text. Everything else is
+// a plain "<n> <text>".
+int format_line_header(const line_node *node, char *header, size_t header_size, int *send_text) {
+    *send_text = 1;
+    if (interning) {
+        intern_entry *entry = intern_entry_of(node->line);
+        if (entry->wire_id >= 0) {
+            int length = snprintf(header, header_size, "%llu*%ld", node->line_number, entry->wire_id);
+            int id_length = length - snprintf(NULL, 0, "%llu*", node->line_number);
+            if ((size_t)id_length < node->length) {
+                *send_text = 0;
+                return length;
+            }
+        } else if (entry->references > 1 && node->length > 1) {
+            entry->wire_id = next_wire_id++;
+            return snprintf(header, header_size, "%llu+", node->line_number);
+        }
     }
+    return snprintf(header, header_size, "%llu ", node->line_number);
+}
 
-    free(data);
+void write_all(int socket_fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(socket_fd, data, length);
+        if (bytes_written < 0) {
+            perror("Error writing to server");
+            exit(6);
+        }
+        data += bytes_written;
+        length -= bytes_written;
+    }
 }
 
 void send_sorted_data_to_server(int socket_fd, line_node *head) {
     printf("Sending sorted data to server\n");
-    char buffer[1024];
+    char *buffer = (char *)malloc(SEND_BUFFER_SIZE);
+    size_t buffered = 0;
+    size_t total_sent = 0;
     line_node *current = head;
 
+    // Lines are batched into one buffer; ones longer than it bypass it
     while (current) {
-        int bytes_written = snprintf(buffer, 1024, "%d %s\n", current->line_number, current->line);
-        if (!current->next) {
-            buffer[bytes_written] = '\0'; 
-            bytes_written++;
+        char number[48];
+        int send_text;
+        int number_length = format_line_header(current, number, sizeof(number), &send_text);
+        size_t text_length = send_text ? current->length : 0;
+        size_t record_length = number_length + text_length + 1;
+
+        if (buffered + record_length > SEND_BUFFER_SIZE) {
+            write_all(socket_fd, buffer, buffered);
+            total_sent += buffered;
+            buffered = 0;
         }
-        printf("Sending %d bytes\n", bytes_written);
-        printf("Sending: %s\n", buffer);
-        if (write(socket_fd, buffer, bytes_written) != bytes_written) {
-            perror("Error writing to server");
-            exit(6);
+        if (record_length > SEND_BUFFER_SIZE) {
+            write_all(socket_fd, number, number_length);
+            write_all(socket_fd, current->line, text_length);
+            write_all(socket_fd, "\n", 1);
+            total_sent += record_length;
+        } else {
+            memcpy(buffer + buffered, number, number_length);
+            memcpy(buffer + buffered + number_length, current->line, text_length);
+            buffer[buffered + record_length - 1] = '\n';
+            buffered += record_length;
         }
+        #ifdef DEBUG
+            printf("Sending: %llu %s\n", current->line_number, current->line);
+        #endif
         current = current->next;
     }
+
+    // The terminating NUL marks the end of the sorted fragment
+    if (buffered == SEND_BUFFER_SIZE) {
+        write_all(socket_fd, buffer, buffered);
+        total_sent += buffered;
+        buffered = 0;
+    }
+    buffer[buffered++] = '\0';
+    write_all(socket_fd, buffer, buffered);
+    total_sent += buffered;
+
+    printf("Sent %zu bytes\n", total_sent);
+    free(buffer);
 }
 
 void cleanup_and_exit(int socket_fd, line_node *head) {
@@ -1,13 +1,15 @@
 // Program: file_shuffle_cut.cpp
 // Author: Chris Gill
 // Purpose: reads lines of a text file and numbers them, shuffles them, and
-//          cuts them into separate files with fragments of the original text
+//          cuts them into separate files with fragments of the original text,
+//          recording a checksum of the original text in a sidecar file
 
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <algorithm>
 #include <sstream>
+#include "line_checksum.h"
 using namespace std;
 
 // return codes for success or failure
@@ -25,7 +27,7 @@ const int expected_argc = 3;
 // struct to hold a numbered line of text
 struct numbered_line {
     numbered_line() : number(0) {}
-    int number;
+    unsigned long long number;
     string text;
 };
 
@@ -55,6 +57,26 @@ int write_fragment (vector<numbered_line>::const_iterator iter,
     return success;
 }
 
+// writes the line count and checksums of the lines, in their original
+// order, so the reassembled output can be verified as it is written
+int write_checksum (const vector<numbered_line> & lines, const char * filename)
+{
+    line_checksum checksum;
+    line_checksum_init(&checksum);
+    for (vector<numbered_line>::const_iterator iter = lines.begin(); iter != lines.end(); ++iter) {
+        line_checksum_add(&checksum, iter->text.data(), iter->text.size());
+    }
+
+    ofstream ofs (filename);
+    if (!ofs) {
+        cout << "Could not open output file " <<  filename << endl;
+        return output_file_open_failed;
+    }
+    ofs << checksum.lines << " " << hex << checksum.ordered << " " << checksum.sum << endl;
+
+    return success;
+}
+
 
 int main (int argc, char *argv[]) {
 
@@ -79,24 +101,32 @@ int main (int argc, char *argv[]) {
         nl.number++;
     }
 
+    // record the checksum of the original order before shuffling
+    string checksum_file_name = string(argv[file_name_index]) + ".checksum";
+    int checksum_result = write_checksum(nlv, checksum_file_name.c_str());
+    if (checksum_result != success) return checksum_result;
+
     // shuffle the numbered lines in the vector
     random_shuffle (nlv.begin(), nlv.end());
 
     // extract (and possibly reduce) number of fragments to create
-    int fragments;
+    vector<numbered_line>::size_type fragments = 0;
     istringstream iss (argv[fragments_index]);
     iss >> fragments;
     if (fragments > nlv.size()) {
         fragments = nlv.size();
     }
+    if (fragments == 0) {
+        return usage(argv[program_name_index], wrong_number_of_arguments);
+    }
 
     // calculate number of lines per fragment, initialize iterators
-    int lines_per_fragment = nlv.size() / fragments;
+    vector<numbered_line>::size_type lines_per_fragment = nlv.size() / fragments;
     vector<numbered_line>::const_iterator start = nlv.begin();
     vector<numbered_line>::const_iterator stop = start + lines_per_fragment;
 
     // output fragments of shuffled text into files    
-    for (int fragment = 1; fragment <= fragments; ++fragment) {
+    for (vector<numbered_line>::size_type fragment = 1; fragment <= fragments; ++fragment) {
         if (stop > nlv.end() || fragment == fragments) stop = nlv.end();
 
         ostringstream file_name_stream;
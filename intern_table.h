@@ -0,0 +1,128 @@
+// Interned line text: each distinct text is stored once and shared by every
+// line with that text, counted by references. Used by the client and the
+// server when interning is enabled.
+//
+// Tables are only ever touched by one thread at a time (the client, and the
+// server's event loop; the output threads only read texts), so there is no
+// locking.
+
+#ifndef INTERN_TABLE_H
+#define INTERN_TABLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "line_checksum.h"
+
+#define INTERN_INITIAL_BUCKETS 1024
+
+typedef struct intern_entry {
+    struct intern_entry *next;      // next entry in the same bucket
+    unsigned long long hash;
+    size_t length;
+    size_t references;
+    long wire_id;                   // back-reference id once sent, -1 before
+    char text[];
+} intern_entry;
+
+typedef struct intern_table {
+    intern_entry **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+} intern_table;
+
+static inline void intern_table_init(intern_table *table) {
+    table->num_buckets = INTERN_INITIAL_BUCKETS;
+    table->buckets = (intern_entry **)calloc(table->num_buckets, sizeof(intern_entry *));
+    table->num_entries = 0;
+}
+
+// Memory held by one interned text of the given length.
+static inline size_t intern_entry_bytes(size_t length) {
+    return sizeof(intern_entry) + length + 1;
+}
+
+static inline intern_entry *intern_entry_of(const char *text) {
+    return (intern_entry *)(text - offsetof(intern_entry, text));
+}
+
+static inline void intern_table_grow(intern_table *table) {
+    size_t num_buckets = table->num_buckets * 2;
+    intern_entry **buckets = (intern_entry **)calloc(num_buckets, sizeof(intern_entry *));
+    for (size_t b = 0; b < table->num_buckets; b++) {
+        intern_entry *entry = table->buckets[b];
+        while (entry) {
+            intern_entry *next = entry->next;
+            entry->next = buckets[entry->hash & (num_buckets - 1)];
+            buckets[entry->hash & (num_buckets - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->num_buckets = num_buckets;
+}
+
+// Returns the shared copy of text, taking a reference to it. Sets *added
+// when this is the first reference.
+static inline char *intern_text(intern_table *table, const char *text, size_t length, int *added) {
+    unsigned long long hash = line_checksum_hash(text, length);
+    intern_entry **bucket = &table->buckets[hash & (table->num_buckets - 1)];
+    for (intern_entry *entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->length == length && memcmp(entry->text, text, length) == 0) {
+            entry->references++;
+            *added = 0;
+            return entry->text;
+        }
+    }
+
+    intern_entry *entry = (intern_entry *)malloc(intern_entry_bytes(length));
+    entry->hash = hash;
+    entry->length = length;
+    entry->references = 1;
+    entry->wire_id = -1;
+    memcpy(entry->text, text, length);
+    entry->text[length] = '\0';
+    entry->next = *bucket;
+    *bucket = entry;
+    *added = 1;
+
+    if (++table->num_entries > table->num_buckets) {
+        intern_table_grow(table);
+    }
+    return entry->text;
+}
+
+// Drops a reference to an interned text. Returns 1 if it was the last one
+// and the text was freed.
+static inline int intern_release(intern_table *table, const char *text) {
+    intern_entry *entry = intern_entry_of(text);
+    if (--entry->references > 0) {
+        return 0;
+    }
+    intern_entry **link = &table->buckets[entry->hash & (table->num_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    table->num_entries--;
+    free(entry);
+    return 1;
+}
+
+static inline void intern_table_free(intern_table *table) {
+    for (size_t b = 0; b < table->num_buckets; b++) {
+        intern_entry *entry = table->buckets[b];
+        while (entry) {
+            intern_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->num_buckets = 0;
+    table->num_entries = 0;
+}
+
+#endif
@@ -0,0 +1,74 @@
+// Streaming checksum of a sequence of lines, shared by file_shuffle_cut,
+// which records it for the original input, and the server, which computes
+// it over the output as it is written.
+//
+// Each line's text is hashed with 64-bit FNV-1a. The ordered checksum folds
+// the line hashes in as a polynomial, ordered = ordered * BASE + hash
+// (mod 2^64), so it changes if lines are reordered, and the checksums of
+// consecutive ranges combine without rehashing. The sum adds the line hashes
+// and ignores order, for outputs sorted by a key other than the line.
+
+#ifndef LINE_CHECKSUM_H
+#define LINE_CHECKSUM_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define LINE_CHECKSUM_BASE 0x9e3779b97f4a7c15ULL
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct line_checksum {
+    unsigned long long lines;
+    unsigned long long ordered;
+    unsigned long long sum;
+} line_checksum;
+
+static inline void line_checksum_init(line_checksum *checksum) {
+    checksum->lines = 0;
+    checksum->ordered = 0;
+    checksum->sum = 0;
+}
+
+static inline unsigned long long line_checksum_hash(const char *text, size_t length) {
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static inline void line_checksum_add(line_checksum *checksum, const char *text, size_t length) {
+    unsigned long long hash = line_checksum_hash(text, length);
+    checksum->lines++;
+    checksum->ordered = checksum->ordered * LINE_CHECKSUM_BASE + hash;
+    checksum->sum += hash;
+}
+
+// Appends the checksum of the lines that follow those already in checksum.
+static inline void line_checksum_append(line_checksum *checksum, const line_checksum *next) {
+    unsigned long long power = 1, base = LINE_CHECKSUM_BASE;
+    for (unsigned long long exponent = next->lines; exponent > 0; exponent >>= 1) {
+        if (exponent & 1) {
+            power *= base;
+        }
+        base *= base;
+    }
+    checksum->lines += next->lines;
+    checksum->ordered = checksum->ordered * power + next->ordered;
+    checksum->sum += next->sum;
+}
+
+// Sidecar files hold one "<lines> <ordered> <sum>" line, checksums in hex.
+static inline int line_checksum_read(const char *filename, line_checksum *checksum) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        return -1;
+    }
+    int fields = fscanf(file, "%llu %llx %llx", &checksum->lines, &checksum->ordered, &checksum->sum);
+    fclose(file);
+    return fields == 3 ? 0 : -1;
+}
+
+#endif
@@ -4,10 +4,12 @@
 
 static line_node *head = NULL;
 
-void insert_line_node(int line_number, const char *line) {
+void insert_line_node(unsigned long long line_number, const char *line) {
     line_node *new_node = (line_node *)malloc(sizeof(line_node));
     new_node->line_number = line_number;
     new_node->line = strdup(line);
+    new_node->length = strlen(line);
+    new_node->key = line_number;
     new_node->next = NULL;
 
     if (!head || line_number < head->line_number) {
@@ -1,10 +1,18 @@
+#ifndef LINE_NODE_H
+#define LINE_NODE_H
+
+#include <stddef.h>
+
 typedef struct line_node {
-    int line_number;
+    unsigned long long line_number;
     char *line;
+    size_t length;
+    unsigned long long key;     // normalized first sort key component
     struct line_node *next;
 } line_node;
 
-void insert_line_node(int line_number, const char *line);
+void insert_line_node(unsigned long long line_number, const char *line);
 line_node *get_head();
 void free_line_nodes();
 
+#endif
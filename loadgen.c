@@ -0,0 +1,603 @@
+// Load generator: one process that acts as many clients at once, to measure
+// the server under realistic fan-out.
+//
+// Build: gcc -O2 -o loadgen loadgen.c
+// Usage: loadgen [-n workers] [-t think_ms] [-s sort_ns_per_line] [-f failure_rate]
+//                [-k sort_key] <address> <port>
+//
+// Every worker connects, reports capabilities, receives its fragment, sorts
+// it, waits out its think time plus a simulated sort cost, and sends the
+// sorted lines back, all on non-blocking sockets driven by one epoll loop.
+// Sort costs vary by up to 50% either way between workers and are reported
+// in the HELLO line. With the failure rate, a worker disconnects either while
+// receiving or partway through its reply. Workers the server never assigns
+// a fragment see it close the connection when the job ends.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include "line_node.h"
+#include "sort_key.h"
+
+typedef enum worker_state {
+    WORKER_CONNECTING,
+    WORKER_RECEIVING,
+    WORKER_SORTING,
+    WORKER_SENDING,
+    WORKER_DONE
+} worker_state;
+
+typedef enum worker_outcome {
+    OUTCOME_COMPLETED,
+    OUTCOME_FAILED,                 // injected failure
+    OUTCOME_UNASSIGNED,             // server finished without giving it work
+    OUTCOME_ERROR,
+    NUM_OUTCOMES
+} worker_outcome;
+
+typedef enum latency_phase {
+    PHASE_CONNECT,                  // connect() until connected
+    PHASE_QUEUE,                    // HELLO sent until the first fragment byte
+    PHASE_RECEIVE,                  // first fragment byte until its NUL
+    PHASE_REPLY,                    // sorted until the reply's NUL is written
+    PHASE_TOTAL,                    // connect() until the reply's NUL is written
+    NUM_PHASES
+} latency_phase;
+
+typedef struct worker {
+    int socket;
+    worker_state state;
+    worker_outcome outcome;
+    long long sort_ns;              // simulated sort cost per line
+    int fails_receiving;            // injected failure while receiving
+    double fail_fraction;           // share of the reply sent before failing, or -1
+    char *data;                     // fragment as received, then the reply
+    size_t length;
+    size_t capacity;
+    size_t sent;
+    unsigned long long lines;
+    long long started;              // monotonic ns of each phase boundary
+    long long connected;
+    long long first_byte;
+    long long received;
+    long long ready;                // think time and sort cost elapsed
+} worker;
+
+typedef struct loadgen_args {
+    char *address;
+    int port;
+    int workers;
+    long long think_ms;
+    long long sort_ns;
+    double failure_rate;
+    sort_key_spec sort_key;
+} loadgen_args;
+
+#define LATENCY_BUCKETS 40
+
+// Log2 buckets of microseconds
+typedef struct latency_histogram {
+    unsigned long long buckets[LATENCY_BUCKETS];
+    unsigned long long count;
+    long long max_ns;
+} latency_histogram;
+
+loadgen_args parse_arguments(int argc, char *argv[]);
+void raise_file_limit(int workers);
+long long monotonic_ns();
+double next_uniform();
+void start_worker(int epoll_fd, worker *w, const struct sockaddr_in *server_addr, const loadgen_args *args);
+void set_worker_events(int epoll_fd, worker *w, unsigned int events);
+void finish_worker(int epoll_fd, worker *w, worker_outcome outcome);
+void handle_connected(int epoll_fd, worker *w);
+void handle_receive(int epoll_fd, worker *w, const loadgen_args *args);
+void sort_fragment(worker *w, const sort_key_spec *sort_key);
+void handle_send(int epoll_fd, worker *w);
+void push_timer(worker *w);
+worker *pop_timer();
+void record_latency(latency_phase phase, long long ns);
+void print_report(const worker *workers, int count, double elapsed);
+
+#define RECEIVE_CHUNK_SIZE 65536
+#define MAX_EVENTS 256
+#define DEFAULT_WORKERS 1000
+#define DEFAULT_SORT_NS 200
+
+static const char *outcome_names[] = { "completed", "failed", "unassigned", "error" };
+static const char *phase_names[] = { "connect", "queue", "receive", "reply", "total" };
+
+static latency_histogram histograms[NUM_PHASES];
+static unsigned long long random_state = 88172645463325252ULL;
+static worker **timers = NULL;      // min-heap of sorting workers by ready time
+static int num_timers = 0;
+static int active_workers = 0;
+
+int main(int argc, char *argv[]) {
+    loadgen_args args = parse_arguments(argc, argv);
+    raise_file_limit(args.workers);
+    // Injected failures leave the server writing to closed sockets; ours too
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(args.port);
+    if (inet_pton(AF_INET, args.address, &server_addr.sin_addr) <= 0) {
+        perror("Invalid address");
+        exit(3);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("Error creating epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    worker *workers = (worker *)calloc(args.workers, sizeof(worker));
+    timers = (worker **)malloc(sizeof(worker *) * args.workers);
+    long long start = monotonic_ns();
+    for (int i = 0; i < args.workers; i++) {
+        start_worker(epoll_fd, &workers[i], &server_addr, &args);
+    }
+    printf("Started %d workers\n", args.workers);
+
+    while (active_workers > 0) {
+        int timeout = -1;
+        if (num_timers > 0) {
+            long long remaining = timers[0]->ready - monotonic_ns();
+            timeout = remaining > 0 ? (int)((remaining + 999999) / 1000000) : 0;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready < 0) {
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            worker *w = (worker *)events[i].data.ptr;
+            if (w->state == WORKER_CONNECTING) {
+                handle_connected(epoll_fd, w);
+            } else if (w->state == WORKER_RECEIVING) {
+                handle_receive(epoll_fd, w, &args);
+            } else if (w->state == WORKER_SENDING) {
+                handle_send(epoll_fd, w);
+            } else if (w->state == WORKER_SORTING) {
+                // Nothing is expected until the reply; the server closing means the job is over
+                finish_worker(epoll_fd, w, OUTCOME_ERROR);
+            }
+        }
+
+        // Workers whose think time and sort cost have elapsed start replying
+        long long now = monotonic_ns();
+        while (num_timers > 0 && timers[0]->ready <= now) {
+            worker *w = pop_timer();
+            if (w->state != WORKER_SORTING) {
+                continue;
+            }
+            w->state = WORKER_SENDING;
+            set_worker_events(epoll_fd, w, EPOLLOUT);
+            handle_send(epoll_fd, w);
+        }
+    }
+
+    print_report(workers, args.workers, (monotonic_ns() - start) / 1e9);
+    close(epoll_fd);
+    free(timers);
+    free(workers);
+    return 0;
+}
+
+loadgen_args parse_arguments(int argc, char *argv[]) {
+    loadgen_args args;
+    args.workers = DEFAULT_WORKERS;
+    args.think_ms = 0;
+    args.sort_ns = DEFAULT_SORT_NS;
+    args.failure_rate = 0;
+    default_sort_key_spec(&args.sort_key);
+
+    int option;
+    int valid = 1;
+    while ((option = getopt(argc, argv, "n:t:s:f:k:")) != -1) {
+        switch (option) {
+        case 'n':
+            args.workers = atoi(optarg);
+            valid = valid && args.workers > 0;
+            break;
+        case 't':
+            args.think_ms = atoll(optarg);
+            valid = valid && args.think_ms >= 0;
+            break;
+        case 's':
+            args.sort_ns = atoll(optarg);
+            valid = valid && args.sort_ns >= 0;
+            break;
+        case 'f':
+            args.failure_rate = atof(optarg);
+            valid = valid && args.failure_rate >= 0 && args.failure_rate <= 1;
+            break;
+        case 'k':
+            valid = valid && parse_sort_key_spec(optarg, &args.sort_key) == 0;
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+    }
+
+    if (!valid || argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-n workers] [-t think_ms] [-s sort_ns_per_line] [-f failure_rate] "
+                "[-k sort_key] <address> <port>\n", argv[0]);
+        exit(1);
+    }
+
+    args.address = argv[optind];
+    args.port = atoi(argv[optind + 1]);
+    return args;
+}
+
+// Each worker holds one socket, so the default descriptor limit is too low.
+void raise_file_limit(int workers) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+    rlim_t wanted = (rlim_t)workers + 64;
+    if (limit.rlim_cur < wanted) {
+        limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < wanted) {
+            fprintf(stderr, "Only %llu file descriptors available for %d workers\n",
+                    (unsigned long long)limit.rlim_cur, workers);
+        }
+    }
+}
+
+long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+double next_uniform() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (random_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void start_worker(int epoll_fd, worker *w, const struct sockaddr_in *server_addr, const loadgen_args *args) {
+    w->sort_ns = (long long)(args->sort_ns * (0.5 + next_uniform()));
+    w->fails_receiving = 0;
+    w->fail_fraction = -1;
+    if (next_uniform() < args->failure_rate) {
+        if (next_uniform() < 0.5) {
+            w->fails_receiving = 1;
+        } else {
+            w->fail_fraction = next_uniform();
+        }
+    }
+    w->started = monotonic_ns();
+    active_workers++;
+
+    w->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (w->socket < 0) {
+        perror("Error creating socket");
+        w->state = WORKER_DONE;
+        w->outcome = OUTCOME_ERROR;
+        active_workers--;
+        return;
+    }
+    if (connect(w->socket, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("Error connecting to server");
+        close(w->socket);
+        w->state = WORKER_DONE;
+        w->outcome = OUTCOME_ERROR;
+        active_workers--;
+        return;
+    }
+
+    w->state = WORKER_CONNECTING;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = w;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->socket, &ev) < 0) {
+        perror("Error adding worker socket to epoll");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_worker_events(int epoll_fd, worker *w, unsigned int events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->socket, &ev) < 0) {
+        perror("Error updating worker socket in epoll");
+    }
+}
+
+void finish_worker(int epoll_fd, worker *w, worker_outcome outcome) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->socket, NULL);
+    close(w->socket);
+    w->socket = -1;
+    w->state = WORKER_DONE;
+    w->outcome = outcome;
+    free(w->data);
+    w->data = NULL;
+    active_workers--;
+}
+
+void handle_connected(int epoll_fd, worker *w) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (getsockopt(w->socket, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+        fprintf(stderr, "Error connecting to server: %s\n", strerror(error ? error : errno));
+        finish_worker(epoll_fd, w, OUTCOME_ERROR);
+        return;
+    }
+    w->connected = monotonic_ns();
+    record_latency(PHASE_CONNECT, w->connected - w->started);
+
+    // The reported throughput matches the simulated sort cost
+    char hello[128];
+    long long throughput = w->sort_ns > 0 ? 1000000000LL / w->sort_ns : 1000000000LL;
+    int length = snprintf(hello, sizeof(hello), "HELLO 1 1024 %lld\n", throughput);
+    if (write(w->socket, hello, length) != length) {
+        perror("Error writing to server");
+        finish_worker(epoll_fd, w, OUTCOME_ERROR);
+        return;
+    }
+
+    w->state = WORKER_RECEIVING;
+    set_worker_events(epoll_fd, w, EPOLLIN);
+}
+
+void handle_receive(int epoll_fd, worker *w, const loadgen_args *args) {
+    for (;;) {
+        if (w->capacity - w->length < RECEIVE_CHUNK_SIZE) {
+            w->capacity = w->capacity ? w->capacity * 2 : RECEIVE_CHUNK_SIZE;
+            w->data = (char *)realloc(w->data, w->capacity + 1);
+        }
+        ssize_t bytes_read = read(w->socket, w->data + w->length, w->capacity - w->length);
+        if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            finish_worker(epoll_fd, w, OUTCOME_ERROR);
+            return;
+        }
+        if (bytes_read == 0) {
+            finish_worker(epoll_fd, w, w->length == 0 ? OUTCOME_UNASSIGNED : OUTCOME_ERROR);
+            return;
+        }
+        if (w->length == 0) {
+            w->first_byte = monotonic_ns();
+            record_latency(PHASE_QUEUE, w->first_byte - w->connected);
+        }
+        w->length += bytes_read;
+
+        if (w->fails_receiving) {
+            finish_worker(epoll_fd, w, OUTCOME_FAILED);
+            return;
+        }
+        if (w->data[w->length - 1] == '\0') {
+            break;
+        }
+    }
+
+    w->received = monotonic_ns();
+    record_latency(PHASE_RECEIVE, w->received - w->first_byte);
+    sort_fragment(w, &args->sort_key);
+
+    long long think_ns = (long long)(args->think_ms * 2000000.0 * next_uniform());
+    w->ready = monotonic_ns() + think_ns + (long long)w->lines * w->sort_ns;
+    w->state = WORKER_SORTING;
+    set_worker_events(epoll_fd, w, EPOLLIN);
+    push_timer(w);
+}
+
+// Sorts the received lines with the job's key and replaces the fragment
+// with the reply, so the server gets the same data a real client sends.
+void sort_fragment(worker *w, const sort_key_spec *sort_key) {
+    w->data[w->length - 1] = '\0';
+    size_t count = 0;
+    for (size_t i = 0; i + 1 < w->length; i++) {
+        count += w->data[i] == '\n';
+    }
+    line_node *nodes = (line_node *)malloc(sizeof(line_node) * (count + 1));
+    line_node **order = (line_node **)malloc(sizeof(line_node *) * (count + 1));
+
+    // Lines are parsed in place; their texts still point into the fragment
+    w->lines = 0;
+    char *line = w->data;
+    while (*line) {
+        char *end = strchr(line, '\n');
+        size_t line_length = end ? (size_t)(end - line) : strlen(line);
+        if (line_length > 0) {
+            char *text_start;
+            line_node *node = &nodes[w->lines];
+            node->line_number = strtoull(line, &text_start, 10);
+            if (text_start > line + line_length) {
+                text_start = line + line_length;
+            }
+            if (text_start < line + line_length && *text_start == ' ') {
+                text_start++;
+            }
+            node->line = text_start;
+            node->length = line_length - (text_start - line);
+            node->key = sort_key_normalize(sort_key, node);
+            order[w->lines++] = node;
+        }
+        line += line_length;
+        if (*line == '\n') {
+            line++;
+        }
+    }
+
+    sort_line_nodes(sort_key, order, w->lines);
+
+    // The reply's line numbers need not be as wide as the fragment's
+    size_t reply_size = 1;
+    for (unsigned long long i = 0; i < w->lines; i++) {
+        reply_size += snprintf(NULL, 0, "%llu ", order[i]->line_number) + order[i]->length + 1;
+    }
+    char *reply = (char *)malloc(reply_size);
+    size_t reply_length = 0;
+    for (unsigned long long i = 0; i < w->lines; i++) {
+        reply_length += sprintf(reply + reply_length, "%llu ", order[i]->line_number);
+        memcpy(reply + reply_length, order[i]->line, order[i]->length);
+        reply_length += order[i]->length;
+        reply[reply_length++] = '\n';
+    }
+    reply[reply_length++] = '\0';
+
+    free(order);
+    free(nodes);
+    free(w->data);
+    w->data = reply;
+    w->length = reply_length;
+    w->capacity = w->length;
+    w->sent = 0;
+}
+
+void handle_send(int epoll_fd, worker *w) {
+    size_t limit = w->length;
+    if (w->fail_fraction >= 0) {
+        limit = (size_t)(w->length * w->fail_fraction);
+    }
+
+    while (w->sent < limit) {
+        ssize_t bytes_written = write(w->socket, w->data + w->sent, limit - w->sent);
+        if (bytes_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            finish_worker(epoll_fd, w, OUTCOME_ERROR);
+            return;
+        }
+        w->sent += bytes_written;
+    }
+
+    if (w->fail_fraction >= 0) {
+        finish_worker(epoll_fd, w, OUTCOME_FAILED);
+        return;
+    }
+    long long now = monotonic_ns();
+    record_latency(PHASE_REPLY, now - w->ready);
+    record_latency(PHASE_TOTAL, now - w->started);
+    finish_worker(epoll_fd, w, OUTCOME_COMPLETED);
+}
+
+void push_timer(worker *w) {
+    int i = num_timers++;
+    while (i > 0 && timers[(i - 1) / 2]->ready > w->ready) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i] = w;
+}
+
+worker *pop_timer() {
+    worker *top = timers[0];
+    worker *last = timers[--num_timers];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= num_timers) {
+            break;
+        }
+        if (child + 1 < num_timers && timers[child + 1]->ready < timers[child]->ready) {
+            child++;
+        }
+        if (last->ready <= timers[child]->ready) {
+            break;
+        }
+        timers[i] = timers[child];
+        i = child;
+    }
+    if (num_timers > 0) {
+        timers[i] = last;
+    }
+    return top;
+}
+
+void record_latency(latency_phase phase, long long ns) {
+    latency_histogram *histogram = &histograms[phase];
+    int bucket = 0;
+    for (long long us = ns / 1000; us > 0 && bucket < LATENCY_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    if (ns > histogram->max_ns) {
+        histogram->max_ns = ns;
+    }
+}
+
+// Upper bound, in ms, of the bucket holding the given quantile
+static double latency_quantile(const latency_histogram *histogram, double quantile) {
+    unsigned long long target = (unsigned long long)(histogram->count * quantile);
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > target) {
+            double bound = (1ULL << bucket) / 1000.0;
+            return bound < histogram->max_ns / 1e6 ? bound : histogram->max_ns / 1e6;
+        }
+    }
+    return histogram->max_ns / 1e6;
+}
+
+void print_report(const worker *workers, int count, double elapsed) {
+    unsigned long long outcomes[NUM_OUTCOMES] = { 0 };
+    unsigned long long lines = 0;
+    for (int i = 0; i < count; i++) {
+        outcomes[workers[i].outcome]++;
+        if (workers[i].outcome == OUTCOME_COMPLETED) {
+            lines += workers[i].lines;
+        }
+    }
+
+    printf("%d workers in %.3f s:", count, elapsed);
+    for (int o = 0; o < NUM_OUTCOMES; o++) {
+        printf(" %llu %s", outcomes[o], outcome_names[o]);
+    }
+    printf("\n%llu lines sorted, %.0f lines/s\n", lines, elapsed > 0 ? lines / elapsed : 0);
+
+    printf("%-8s %8s %10s %10s %10s %10s\n", "phase", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        const latency_histogram *histogram = &histograms[p];
+        if (histogram->count == 0) {
+            continue;
+        }
+        printf("%-8s %8llu %10.3f %10.3f %10.3f %10.3f\n", phase_names[p], histogram->count,
+               latency_quantile(histogram, 0.5), latency_quantile(histogram, 0.9),
+               latency_quantile(histogram, 0.99), histogram->max_ns / 1e6);
+    }
+
+    // Full histograms: connections per power-of-two latency bucket
+    for (int p = 0; p < NUM_PHASES; p++) {
+        const latency_histogram *histogram = &histograms[p];
+        if (histogram->count == 0) {
+            continue;
+        }
+        printf("\n%s latency:\n", phase_names[p]);
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            if (histogram->buckets[bucket]) {
+                printf("  < %12.3f ms %8llu\n", (1ULL << bucket) / 1000.0, histogram->buckets[bucket]);
+            }
+        }
+    }
+}
@@ -6,52 +6,151 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include "line_node.h"
+#include "sort_key.h"
+#include "line_checksum.h"
+#include "intern_table.h"
 
 typedef struct client_info {
     int socket;                     
-    FILE *fragment_file;            
+    FILE *fragment_file;            // NULL until a fragment is assigned
+    int fragment;                   // index of the assigned fragment
+    int fragment_sent;              // fragment and its terminating NUL written
+    int has_capabilities;           // HELLO line received
+    long cores;
+    long memory_mb;
+    long long throughput;           // lines per second reported by the client
+    char *recv_buffer;              // unparsed tail carried between reads
+    size_t recv_length;
+    size_t recv_capacity;
+    line_node **run;                // lines received so far, sorted on completion
+    size_t run_length;
+    size_t run_capacity;
+    size_t run_consumed;            // leading run entries already streamed out
+    size_t held_bytes;              // memory charged to this connection
+    unsigned long long last_key;    // key of the latest line received
+    int paused;                     // EPOLLIN withheld by back-pressure
+    char **dictionary;              // texts the client defined for back-references
+    size_t *dictionary_lengths;
+    size_t dictionary_length;
+    size_t dictionary_capacity;
     struct client_info *next;       
 } client_info;
 
-typedef struct line_node {
-    int line_number;
-    char *line;
-    struct line_node *next;
-} line_node;
+typedef struct sorted_run {
+    line_node **nodes;              // a completed client's lines in key order
+    size_t length;
+    size_t consumed;                // leading entries already streamed out
+    size_t charged;                 // bytes of the nodes array counted against the global budget
+} sorted_run;
+
+typedef struct merge_cursor {
+    line_node **next;
+    line_node **end;
+} merge_cursor;
+
+typedef struct output_slice {
+    size_t *begin;                  // per-run index range merged by one thread
+    size_t *end;
+    size_t bytes;                   // formatted size of the range
+    off_t offset;                   // where the range goes in the output file
+    int fd;
+    int status;
+    line_checksum checksum;         // of the range, when verifying
+} output_slice;
+
+typedef struct flow_limits {
+    int dispatch_window;            // ms to wait for HELLOs before assigning
+    size_t connection_budget;       // bytes one connection may hold
+    size_t global_budget;           // bytes all connections may hold together
+    int max_outstanding;            // fragments in flight at once, 0 for no cap
+} flow_limits;
 
 // Function declarations
-void parse_arguments(int argc, char *argv[], char **input_filename, int *port);
+void parse_arguments(int argc, char *argv[], char **input_filename, int *port, sort_key_spec *sort_key, flow_limits *limits, int *output_threads, char **checksum_filename, int *interning);
+size_t parse_size(const char *text);
 int open_files(char *input_filename, char **output_filename, FILE ***fragment_files, int *num_fragments);
 int create_and_bind_socket(int port);
 void event_handling(int server_socket, FILE **fragment_files, int num_fragments, char *output_filename);
 void manage_data_structures(int client_socket, FILE *fragment_file);
-void write_output(const char *output_filename);
+int write_output(const char *output_filename);
+int verify_output(const char *checksum_filename);
 void cleanup(int epoll_fd, struct client_info *clients, FILE **fragment_files, int num_fragments);
 int accept_client(int server_socket);
-void add_client_to_epoll(int epoll_fd, int client_socket);
+void add_client_to_epoll(int epoll_fd, struct client_info *client);
 struct client_info *add_client_to_list(struct client_info *clients, int client_socket, FILE *fragment_file);
-struct client_info *find_client(struct client_info *clients, int client_socket);
+int *order_fragments_by_size(FILE **fragment_files, int num_fragments);
+int parse_capabilities(struct client_info *client);
+int compare_capabilities(const void *a, const void *b);
+int assign_fragments(int epoll_fd, struct client_info *clients, FILE **fragment_files,
+                     const int *fragment_order, int *next_fragment, int num_fragments, int slots);
+long long monotonic_ms();
+void update_client_events(int epoll_fd, struct client_info *client);
+void charge_bytes(struct client_info *client, size_t bytes);
+void release_bytes(struct client_info *client, size_t bytes);
+void drain_output(struct client_info *clients);
+void apply_back_pressure(int epoll_fd, struct client_info *clients);
 int handle_client_read(struct client_info *client);
-void handle_client_write(struct client_info *client);
-void process_client_data(struct client_info *client, const char *data); 
+void handle_client_write(int epoll_fd, struct client_info *client);
+size_t process_client_data(struct client_info *client, char *data, size_t length, int final);
+void finish_client_data(struct client_info *client);
+void abandon_client_data(struct client_info *client);
+void add_sorted_run(line_node **nodes, size_t length, size_t consumed, size_t charged);
 int read_fragment_data(FILE *fragment_file, char *buffer, int buffer_size); 
-void insert_line_node(int line_number, const char *line);
+void insert_line_node(unsigned long long line_number, const char *line);
 line_node *get_head();
 void free_line_nodes();
-void parse_line(char *input, int *output_int, char **output_str); 
+char *store_text(struct client_info *client, const char *text, size_t length);
+void release_text(struct client_info *client, char *text, size_t length);
+void release_dictionary(struct client_info *client);
+void parse_line(struct client_info *client, char *input, size_t length, unsigned long long *output_number, char **output_str, size_t *output_length);
 
 #define MAX_EVENTS 64
-#define READ_BUFFER_SIZE 4096
-#define WRITE_BUFFER_SIZE 4096
+#define READ_BUFFER_SIZE 65536
+#define HELLO_BUFFER_SIZE 128
+#define WRITE_BUFFER_SIZE 65536
+#define DISPATCH_WINDOW_MS 50
+#define CONNECTION_BUDGET (64ULL << 20)
+#define GLOBAL_BUDGET (1ULL << 30)
+#define OUTPUT_CHUNK_SIZE (1 << 20)
+#define MIN_LINES_PER_THREAD 65536
+#define SPLITTER_OVERSAMPLING 16
 
 
 static line_node *head = NULL;
+static sort_key_spec sort_key;
+static flow_limits limits = { DISPATCH_WINDOW_MS, CONNECTION_BUDGET, GLOBAL_BUDGET, 0 };
+static size_t held_bytes = 0;                   // received lines and buffers in memory
+static FILE *output_stream = NULL;
+static int output_failed = 0;                   // a write to the output file failed
+static unsigned long long output_frontier = 0;  // next line number to stream out
+static unsigned long long streamed_lines = 0;
+static sorted_run *runs = NULL;                 // completed runs awaiting the final merge
+static size_t num_runs = 0;
+static size_t runs_capacity = 0;
+static int output_threads = 1;
+static int verifying = 0;                       // checksumming output lines as they are written
+static line_checksum output_checksum;
+static int interning = 0;                       // repeated line texts stored once
+static intern_table interned;
 
 // Main function
 int main(int argc, char *argv[]) {
     char *input_filename;
+    char *checksum_filename = NULL;
     int port;
-    parse_arguments(argc, argv, &input_filename, &port);
+    output_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    // A client that disconnects mid-fragment must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    parse_arguments(argc, argv, &input_filename, &port, &sort_key, &limits, &output_threads, &checksum_filename, &interning);
+    verifying = checksum_filename != NULL;
+    if (interning) {
+        intern_table_init(&interned);
+    }
 
     #ifdef DEBUG
         printf("Debug mode enabled\n");
@@ -69,11 +168,13 @@ int main(int argc, char *argv[]) {
         printf("Number of fragments: %d\n", num_fragments);
     
         for (int i = 0; i < num_fragments; i++) {
-            char buffer[256];
-            while(fgets(buffer, sizeof(buffer), fragment_files[i]) != NULL) {
-                strtok(buffer, "\n");
+            char *buffer = NULL;
+            size_t buffer_capacity = 0;
+            while(getline(&buffer, &buffer_capacity, fragment_files[i]) >= 0) {
+                buffer[strcspn(buffer, "\n")] = '\0';
                 printf("Fragment file %d: %s\n", i, buffer);
             }
+            free(buffer);
             //reset file pointer
             fseek(fragment_files[i], 0, SEEK_SET);
         }
@@ -87,20 +188,83 @@ int main(int argc, char *argv[]) {
     
     event_handling(server_socket, fragment_files, num_fragments, output_filename);
 
-    write_output(output_filename);
-
+    if (verifying && verify_output(checksum_filename) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (output_failed) {
+        return EXIT_FAILURE;
+    }
     return 0;
 }
 
 // Function implementations
-void parse_arguments(int argc, char *argv[], char **input_filename, int *port) {
-    if (argc != 3) {
-        printf("Usage: %s <input_file> <port>\n", argv[0]);
+void parse_arguments(int argc, char *argv[], char **input_filename, int *port, sort_key_spec *sort_key, flow_limits *limits, int *output_threads, char **checksum_filename, int *interning) {
+    default_sort_key_spec(sort_key);
+
+    int option;
+    int valid = 1;
+    while ((option = getopt(argc, argv, "k:w:c:g:f:t:v:i")) != -1) {
+        switch (option) {
+        case 'k':
+            valid = valid && parse_sort_key_spec(optarg, sort_key) == 0;
+            break;
+        case 'w':
+            limits->dispatch_window = atoi(optarg);
+            valid = valid && limits->dispatch_window >= 0;
+            break;
+        case 'c':
+            limits->connection_budget = parse_size(optarg);
+            valid = valid && limits->connection_budget > 0;
+            break;
+        case 'g':
+            limits->global_budget = parse_size(optarg);
+            valid = valid && limits->global_budget > 0;
+            break;
+        case 'f':
+            limits->max_outstanding = atoi(optarg);
+            valid = valid && limits->max_outstanding >= 0;
+            break;
+        case 't':
+            *output_threads = atoi(optarg);
+            valid = valid && *output_threads > 0;
+            break;
+        case 'v':
+            *checksum_filename = optarg;
+            break;
+        case 'i':
+            *interning = 1;
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+    }
+
+    if (!valid || argc - optind != 2) {
+        printf("Usage: %s [-k sort_key] [-w dispatch_window_ms] [-c connection_budget] "
+               "[-g global_budget] [-f max_outstanding] [-t output_threads] [-v checksum_file] "
+               "[-i] <input_file> <port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    *input_filename = argv[1];
-    *port = atoi(argv[2]);
+    *input_filename = argv[optind];
+    *port = atoi(argv[optind + 1]);
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if invalid.
+size_t parse_size(const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return 0;
+    }
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    default: break;
+    }
+    return *end ? 0 : (size_t)value;
 }
 
 int open_files(char *input_filename, char **output_filename, FILE ***fragment_files, int *num_fragments) {
@@ -110,13 +274,16 @@ int open_files(char *input_filename, char **output_filename, FILE ***fragment_fi
         exit(EXIT_FAILURE);
     }
 
-    char buffer[256];
-    if (fgets(buffer, sizeof(buffer), input_file) == NULL) {
+    // getline keeps file names of any length intact
+    char *buffer = NULL;
+    size_t buffer_capacity = 0;
+    if (getline(&buffer, &buffer_capacity, input_file) < 0) {
         perror("Error reading output filename");
         fclose(input_file);
         exit(EXIT_FAILURE);
     }
 
+    buffer[strcspn(buffer, "\n")] = '\0';
     *output_filename = strdup(buffer);
 
     FILE *output_file = fopen(*output_filename, "w");
@@ -127,20 +294,19 @@ int open_files(char *input_filename, char **output_filename, FILE ***fragment_fi
     }
     fclose(output_file);
 
-    strtok(*output_filename, "\n");
-
     // Read fragment file names and open them
     int fragment_count = 0;
     *fragment_files = NULL;
-    while (fgets(buffer, sizeof(buffer), input_file) != NULL) {
+    while (getline(&buffer, &buffer_capacity, input_file) >= 0) {
         fragment_count++;
         *fragment_files = (FILE **)realloc(*fragment_files, sizeof(FILE *) * fragment_count);
-        strtok(buffer, "\n");
+        buffer[strcspn(buffer, "\n")] = '\0';
         printf("Opening fragment file: %s\n", buffer);
         (*fragment_files)[fragment_count - 1] = fopen(buffer, "r");
         if ((*fragment_files)[fragment_count - 1] == NULL) {
             perror("Error opening fragment file");
             // Clean up
+            free(buffer);
             fclose(input_file);
             for (int i = 0; i < fragment_count - 1; i++) {
                 fclose((*fragment_files)[i]);
@@ -150,6 +316,7 @@ int open_files(char *input_filename, char **output_filename, FILE ***fragment_fi
         }
     }
 
+    free(buffer);
     fclose(input_file);
     *num_fragments = fragment_count;
     return fragment_count;
@@ -179,7 +346,9 @@ int create_and_bind_socket(int port) {
         printf("Server socket: %d\n", server_socket);
     #endif
 
-    listen(server_socket, 5);
+    // Accepted in a loop, so thousands of simultaneous connects are not dropped
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    listen(server_socket, SOMAXCONN);
 
     printf("listening at %s:%d\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
 
@@ -197,21 +366,39 @@ void event_handling(int server_socket, FILE **fragment_files, int num_fragments,
     // Add server_socket to epoll
     struct epoll_event ev;
     ev.events = EPOLLIN;
-    ev.data.fd = server_socket;
+    ev.data.ptr = NULL;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
         perror("Error adding server socket to epoll");
         exit(EXIT_FAILURE);
     }
 
+    // Fragments are handed out largest first
+    int *fragment_order = order_fragments_by_size(fragment_files, num_fragments);
+    int next_fragment = 0;
+    long long dispatch_deadline = -1;
+
+    // Lines continuing the output's line-number prefix are streamed as they arrive
+    output_stream = fopen(output_filename, "w");
+    if (!output_stream) {
+        perror("Error opening output file");
+        exit(EXIT_FAILURE);
+    }
+
     // Main event loop
     int completed_clients = 0;
-    int connected_clients = 0;
+    int waiting_clients = 0;
     client_info *clients = NULL;
 
     while (completed_clients < num_fragments) {
 
+        int timeout = -1;
+        if (dispatch_deadline >= 0) {
+            long long remaining = dispatch_deadline - monotonic_ms();
+            timeout = remaining > 0 ? (int)remaining : 0;
+        }
+
         struct epoll_event events[MAX_EVENTS];
-        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
         if(ready < 0) {
             perror("Error waiting for events");
             exit(EXIT_FAILURE);
@@ -231,42 +418,95 @@ void event_handling(int server_socket, FILE **fragment_files, int num_fragments,
                 printf("Event fd: %d\n", events[event_idx].data.fd);
                 printf("Event mask: %d\n", events[event_idx].events);
             #endif 
-            if (events[event_idx].data.fd == server_socket) {
-                // Handle new client connection
-                int client_socket = accept_client(server_socket);
-                if (client_socket >= 0) {
-                    add_client_to_epoll(epoll_fd, client_socket);
-                    clients = add_client_to_list(clients, client_socket, fragment_files[connected_clients]);
-                    connected_clients++;
+            if (events[event_idx].data.ptr == NULL) {
+                // Handle new client connections
+                int client_socket;
+                while ((client_socket = accept_client(server_socket)) >= 0) {
+                    clients = add_client_to_list(clients, client_socket, NULL);
+                    add_client_to_epoll(epoll_fd, clients);
+                    waiting_clients++;
                 }
             } else {
                 // Handle read/write events for clients
-                struct client_info *client = find_client(clients, events[event_idx].data.fd);
-
-                if (client == NULL) {
-                    perror("Error finding client in list");
-                    exit(EXIT_FAILURE);
-                }
+                struct client_info *client = (struct client_info *)events[event_idx].data.ptr;
 
-                if (events[event_idx].events & EPOLLIN) {
+                // Hangups are read too, even while paused, to notice failed clients
+                if (events[event_idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
                     // Handle read events
-                    if (handle_client_read(client)) {
-                        // Client completed transfer
+                    int result = handle_client_read(client);
+                    if (result != 0) {
                         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
                         close(client->socket);
-                        completed_clients++;
+                        client->socket = -1;
+                        if (result > 0) {
+                            // Client completed transfer
+                            completed_clients++;
+                        } else if (result == -1) {
+                            // Client left before it was given a fragment
+                            release_bytes(client, client->held_bytes);
+                            free(client->recv_buffer);
+                            client->recv_buffer = NULL;
+                            client->recv_length = 0;
+                            client->recv_capacity = 0;
+                            waiting_clients--;
+                        } else {
+                            // Client failed partway: its fragment goes back to the pool
+                            printf("Client failed, requeueing fragment %d\n", client->fragment);
+                            fragment_order[--next_fragment] = client->fragment;
+                            abandon_client_data(client);
+                        }
+                        continue;
                     }
                 }
 
                 if (events[event_idx].events & EPOLLOUT) {
                     // Handle write events
-                    handle_client_write(client);
+                    handle_client_write(epoll_fd, client);
                 }
             }
         }
+
+        drain_output(clients);
+        apply_back_pressure(epoll_fd, clients);
+
+        // Assign once every open slot has a reporting client, or when the
+        // window closes so slower reporters and old clients still get work.
+        int slots = num_fragments - next_fragment;
+        int outstanding = next_fragment - completed_clients;
+        if (limits.max_outstanding > 0 && limits.max_outstanding - outstanding < slots) {
+            slots = limits.max_outstanding - outstanding;
+        }
+        if (waiting_clients > 0 && slots > 0) {
+            int reporting = 0;
+            for (client_info *current = clients; current; current = current->next) {
+                if (current->socket >= 0 && !current->fragment_file && current->has_capabilities) {
+                    reporting++;
+                }
+            }
+            if (reporting >= slots || (dispatch_deadline >= 0 && monotonic_ms() >= dispatch_deadline)) {
+                waiting_clients -= assign_fragments(epoll_fd, clients, fragment_files, fragment_order,
+                                                    &next_fragment, num_fragments, slots);
+                dispatch_deadline = -1;
+            } else if (dispatch_deadline < 0) {
+                dispatch_deadline = monotonic_ms() + limits.dispatch_window;
+            }
+        } else {
+            dispatch_deadline = -1;
+        }
     }
 
-    write_output(output_filename);
+    free(fragment_order);
+    // Streamed lines may sit in stdio's buffer until the close, so check both
+    int stream_failed = ferror(output_stream);
+    if (fclose(output_stream) != 0 || stream_failed) {
+        perror("Error writing output file");
+        output_failed = 1;
+    }
+    output_stream = NULL;
+    printf("Streamed %llu lines during transfer\n", streamed_lines);
+    if (write_output(output_filename) != 0) {
+        output_failed = 1;
+    }
 }
 
 int accept_client(int server_socket) {
@@ -286,11 +526,11 @@ int accept_client(int server_socket) {
     return client_socket;
 }
 
-void add_client_to_epoll(int epoll_fd, int client_socket) {
+void add_client_to_epoll(int epoll_fd, struct client_info *client) {
     struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLOUT;
-    ev.data.fd = client_socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->socket, &ev) < 0) {
         perror("Error adding client socket to epoll");
         exit(EXIT_FAILURE);
     }
@@ -300,77 +540,375 @@ struct client_info *add_client_to_list(struct client_info *clients, int client_s
     struct client_info *new_client = (struct client_info *)malloc(sizeof(struct client_info));
     new_client->socket = client_socket;
     new_client->fragment_file = fragment_file;
+    new_client->fragment = -1;
+    new_client->fragment_sent = 0;
+    new_client->has_capabilities = 0;
+    new_client->cores = 0;
+    new_client->memory_mb = 0;
+    new_client->throughput = 0;
+    new_client->recv_buffer = NULL;
+    new_client->recv_length = 0;
+    new_client->recv_capacity = 0;
+    new_client->run = NULL;
+    new_client->run_length = 0;
+    new_client->run_capacity = 0;
+    new_client->run_consumed = 0;
+    new_client->held_bytes = 0;
+    new_client->last_key = 0;
+    new_client->paused = 0;
+    new_client->dictionary = NULL;
+    new_client->dictionary_lengths = NULL;
+    new_client->dictionary_length = 0;
+    new_client->dictionary_capacity = 0;
     new_client->next = clients;
     return new_client;
 }
 
-struct client_info *find_client(struct client_info *clients, int client_socket) {
-    struct client_info *current = clients;
-    while (current) {
-        if (current->socket == client_socket) {
-            return current;
+static long long *fragment_sizes_for_order;
+
+static int compare_fragment_sizes(const void *a, const void *b) {
+    long long size_a = fragment_sizes_for_order[*(const int *)a];
+    long long size_b = fragment_sizes_for_order[*(const int *)b];
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+// Returns fragment indices ordered by file size, largest first.
+int *order_fragments_by_size(FILE **fragment_files, int num_fragments) {
+    int *order = (int *)malloc(sizeof(int) * (num_fragments > 0 ? num_fragments : 1));
+    long long *sizes = (long long *)malloc(sizeof(long long) * (num_fragments > 0 ? num_fragments : 1));
+
+    for (int i = 0; i < num_fragments; i++) {
+        struct stat file_stat;
+        sizes[i] = fstat(fileno(fragment_files[i]), &file_stat) == 0 ? (long long)file_stat.st_size : 0;
+        order[i] = i;
+    }
+
+    fragment_sizes_for_order = sizes;
+    qsort(order, num_fragments, sizeof(int), compare_fragment_sizes);
+    fragment_sizes_for_order = NULL;
+
+    #ifdef DEBUG
+        for (int i = 0; i < num_fragments; i++) {
+            printf("Fragment %d: %lld bytes\n", order[i], sizes[order[i]]);
         }
-        current = current->next;
+    #endif
+
+    free(sizes);
+    return order;
+}
+
+// Parses a "HELLO <cores> <memory_mb> <lines_per_second>" line. Returns 1 if
+// a full line was consumed from the receive buffer.
+int parse_capabilities(struct client_info *client) {
+    char *line_end = memchr(client->recv_buffer, '\n', client->recv_length);
+    if (!line_end) {
+        return 0;
     }
-    perror("Error finding client in list");
-    return NULL;
+    *line_end = '\0';
+
+    if (sscanf(client->recv_buffer, "HELLO %ld %ld %lld", &client->cores, &client->memory_mb,
+               &client->throughput) == 3) {
+        client->has_capabilities = 1;
+    }
+    #ifdef DEBUG
+        printf("Client %d capabilities: %ld cores, %ld MB, %lld lines/s\n", client->socket,
+               client->cores, client->memory_mb, client->throughput);
+    #endif
+
+    size_t consumed = line_end + 1 - client->recv_buffer;
+    memmove(client->recv_buffer, line_end + 1, client->recv_length - consumed);
+    client->recv_length -= consumed;
+    return 1;
 }
 
-int handle_client_read(struct client_info *client) {
-    char buffer[READ_BUFFER_SIZE];
-    int bytes_read;
-    int total_bytes_read = 0;
-    int num_loops = 0;
+// Most capable first: measured throughput, then cores, then memory.
+int compare_capabilities(const void *a, const void *b) {
+    const struct client_info *client_a = *(struct client_info * const *)a;
+    const struct client_info *client_b = *(struct client_info * const *)b;
+    if (client_a->throughput != client_b->throughput) {
+        return client_a->throughput > client_b->throughput ? -1 : 1;
+    }
+    if (client_a->cores != client_b->cores) {
+        return client_a->cores > client_b->cores ? -1 : 1;
+    }
+    if (client_a->memory_mb != client_b->memory_mb) {
+        return client_a->memory_mb > client_b->memory_mb ? -1 : 1;
+    }
+    return 0;
+}
 
-    do {
+// Pairs waiting clients, most capable first, with the largest remaining
+// fragments (longest-processing-time-first). Returns the number assigned.
+int assign_fragments(int epoll_fd, struct client_info *clients, FILE **fragment_files,
+                     const int *fragment_order, int *next_fragment, int num_fragments, int slots) {
+    int waiting = 0;
+    for (client_info *current = clients; current; current = current->next) {
+        if (current->socket >= 0 && !current->fragment_file) {
+            waiting++;
+        }
+    }
+    if (waiting == 0) {
+        return 0;
+    }
 
-        bytes_read = read(client->socket, buffer + total_bytes_read, READ_BUFFER_SIZE - 1 - total_bytes_read);
+    struct client_info **candidates = (struct client_info **)malloc(sizeof(struct client_info *) * waiting);
+    int count = 0;
+    for (client_info *current = clients; current; current = current->next) {
+        if (current->socket >= 0 && !current->fragment_file) {
+            candidates[count++] = current;
+        }
+    }
+    qsort(candidates, count, sizeof(struct client_info *), compare_capabilities);
+
+    int assigned = 0;
+    for (int i = 0; i < count && i < slots && *next_fragment < num_fragments; i++) {
+        struct client_info *client = candidates[i];
+        int fragment = fragment_order[(*next_fragment)++];
+        client->fragment_file = fragment_files[fragment];
+        client->fragment = fragment;
+        // Its buffer counts against the budgets from assignment on
+        charge_bytes(client, client->recv_capacity);
+        update_client_events(epoll_fd, client);
+        printf("Assigned fragment %d to client %d (%lld lines/s)\n", fragment, client->socket, client->throughput);
+        assigned++;
+    }
 
-        #ifdef DEBUG
-            if (bytes_read > 0) {
-                printf("Read from client:\n %s\n", buffer);
+    free(candidates);
+    return assigned;
+}
+
+long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Sets epoll interest from the client's state: reads unless paused, writes
+// while an assigned fragment is still being sent.
+void update_client_events(int epoll_fd, struct client_info *client) {
+    struct epoll_event ev;
+    ev.events = 0;
+    if (!client->paused) {
+        ev.events |= EPOLLIN;
+    }
+    if (client->fragment_file && !client->fragment_sent) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = client;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &ev) < 0) {
+        perror("Error updating client socket in epoll");
+    }
+}
+
+// Memory is charged to the receiving connection until its run completes,
+// after which it only counts against the global budget.
+void charge_bytes(struct client_info *client, size_t bytes) {
+    if (client) {
+        client->held_bytes += bytes;
+    }
+    held_bytes += bytes;
+}
+
+void release_bytes(struct client_info *client, size_t bytes) {
+    if (client) {
+        client->held_bytes -= bytes;
+    }
+    held_bytes -= bytes;
+}
+
+static void stream_line(struct client_info *client, line_node *node) {
+    fwrite(node->line, 1, node->length, output_stream);
+    fputc('\n', output_stream);
+    if (verifying && !ferror(output_stream)) {
+        line_checksum_add(&output_checksum, node->line, node->length);
+    }
+    release_bytes(client, sizeof(line_node));
+    release_text(client, node->line, node->length);
+    free(node);
+    output_frontier++;
+    streamed_lines++;
+}
+
+// Writes out every line that continues the contiguous line-number prefix of
+// the output, from completed runs and from runs still arriving, and frees
+// it. This is what lets paused connections drain when sorting by line.
+void drain_output(struct client_info *clients) {
+    if (!output_stream || !sort_key_is_line_order(&sort_key)) {
+        return;
+    }
+
+    int progressed;
+    do {
+        progressed = 0;
+        for (size_t r = 0; r < num_runs; ) {
+            while (runs[r].consumed < runs[r].length &&
+                   runs[r].nodes[runs[r].consumed]->line_number == output_frontier) {
+                stream_line(NULL, runs[r].nodes[runs[r].consumed++]);
+                progressed = 1;
             }
-        #endif
+            // A drained run gives its array back; runs are unordered until the final merge
+            if (runs[r].consumed == runs[r].length) {
+                release_bytes(NULL, runs[r].charged);
+                free(runs[r].nodes);
+                runs[r] = runs[--num_runs];
+            } else {
+                r++;
+            }
+        }
+        for (client_info *current = clients; current; current = current->next) {
+            while (current->run_consumed < current->run_length &&
+                   current->run[current->run_consumed]->line_number == output_frontier) {
+                stream_line(current, current->run[current->run_consumed++]);
+                progressed = 1;
+            }
+            if (current->run_consumed > 0 && current->run_consumed == current->run_length) {
+                current->run_consumed = 0;
+                current->run_length = 0;
+            }
+        }
+    } while (progressed);
+}
 
-        if (bytes_read < 0) {
-            perror("Error reading from client socket\n");
-            return 1;
+// Pauses reading from connections that are ahead of the slowest one while
+// they, or the server as a whole, hold more than their budget; the kernel
+// socket buffers then push back on those clients. The connection furthest
+// behind always keeps reading, since the output frontier waits on it.
+// Paused connections resume below three quarters of the budgets.
+void apply_back_pressure(int epoll_fd, struct client_info *clients) {
+    struct client_info *laggard = NULL;
+    for (client_info *current = clients; current; current = current->next) {
+        if (current->socket >= 0 && current->fragment_file &&
+            (!laggard || current->last_key < laggard->last_key)) {
+            laggard = current;
         }
+    }
 
-        total_bytes_read += bytes_read;
-        num_loops = num_loops + 1;
-        if (num_loops > 10000) {
-            printf("Read loop exceeded 10000 iterations\n");
-            return 1;
+    for (client_info *current = clients; current; current = current->next) {
+        if (current->socket < 0 || !current->fragment_file) {
+            continue;
         }
-    } while (buffer[total_bytes_read - 1] != '\0');
 
-    if (bytes_read > 0) {
-         printf("Finished reading from client\n");
+        int pause;
+        if (current == laggard) {
+            pause = 0;
+        } else if (current->paused) {
+            pause = current->held_bytes > limits.connection_budget / 4 * 3 ||
+                    held_bytes > limits.global_budget / 4 * 3;
+        } else {
+            pause = current->held_bytes > limits.connection_budget || held_bytes > limits.global_budget;
+        }
+
+        if (pause != current->paused) {
+            current->paused = pause;
+            update_client_events(epoll_fd, current);
+            #ifdef DEBUG
+                printf("%s client %d: %zu bytes held, %zu total\n", pause ? "Paused" : "Resumed",
+                       current->socket, current->held_bytes, held_bytes);
+            #endif
+        }
     }
+}
 
-    process_client_data(client, buffer);
-    return bytes_read;
+// Returns 1 once the client's sorted data is complete, -1 if the client
+// disconnected before it was assigned a fragment, -2 if it disconnected
+// before terminating its data, and 0 otherwise.
+int handle_client_read(struct client_info *client) {
+    if (!client->fragment_file) {
+        // An unassigned client only sends its HELLO, read into a small uncharged buffer
+        if (!client->recv_buffer) {
+            client->recv_capacity = HELLO_BUFFER_SIZE;
+            client->recv_buffer = (char *)malloc(client->recv_capacity + 1);
+        }
+        // Filling it without a newline is not a HELLO
+        if (client->recv_length == client->recv_capacity) {
+            return -1;
+        }
+    } else if (client->recv_capacity - client->recv_length < READ_BUFFER_SIZE) {
+        // Keep room for one full read beyond the partial line being carried
+        size_t old_capacity = client->recv_capacity;
+        client->recv_capacity = client->recv_capacity >= READ_BUFFER_SIZE ? client->recv_capacity * 2 : READ_BUFFER_SIZE;
+        client->recv_buffer = (char *)realloc(client->recv_buffer, client->recv_capacity + 1);
+        charge_bytes(client, client->recv_capacity - old_capacity);
+    }
+
+    ssize_t bytes_read = read(client->socket, client->recv_buffer + client->recv_length,
+                              client->recv_capacity - client->recv_length);
+    if (bytes_read < 0) {
+        perror("Error reading from client socket\n");
+        return client->fragment_file ? -2 : -1;
+    }
+
+    #ifdef DEBUG
+        if (bytes_read > 0) {
+            printf("Read from client:\n %.*s\n", (int)bytes_read, client->recv_buffer + client->recv_length);
+        }
+    #endif
+
+    size_t scan_from = client->recv_length;
+    client->recv_length += bytes_read;
+
+    // Before assignment the only thing a client sends is its HELLO line
+    if (!client->fragment_file) {
+        if (bytes_read == 0) {
+            return -1;
+        }
+        parse_capabilities(client);
+        return 0;
+    }
+
+    // A HELLO that missed the dispatch window arrives ahead of the data
+    if (!client->has_capabilities && client->recv_length > 0 && client->recv_buffer[0] == 'H') {
+        if (parse_capabilities(client)) {
+            scan_from = 0;
+        } else if (bytes_read > 0) {
+            return 0;
+        }
+    }
+
+    char *terminator = memchr(client->recv_buffer + scan_from, '\0', client->recv_length - scan_from);
+    if (!terminator && bytes_read == 0) {
+        return -2;
+    }
+    int final = terminator != NULL;
+    size_t end = terminator ? (size_t)(terminator - client->recv_buffer) : client->recv_length;
+
+    size_t consumed = process_client_data(client, client->recv_buffer, end, final);
+    memmove(client->recv_buffer, client->recv_buffer + consumed, client->recv_length - consumed);
+    client->recv_length -= consumed;
+
+    if (final) {
+        finish_client_data(client);
+        printf("Finished reading from client\n");
+        return 1;
+    }
+    return 0;
 }
 
-void handle_client_write(struct client_info *client) {
+void handle_client_write(int epoll_fd, struct client_info *client) {
+    if (client->fragment_sent) {
+        return;
+    }
+
     char buffer[WRITE_BUFFER_SIZE];
-    int bytes_read = read_fragment_data(client->fragment_file, buffer, WRITE_BUFFER_SIZE - 1);
+    int bytes_read = read_fragment_data(client->fragment_file, buffer, WRITE_BUFFER_SIZE);
+    if (bytes_read < 0) {
+        perror("Error reading from fragment file");
+    }
+
     if (bytes_read <= 0) {
-        if (bytes_read < 0) {
-            perror("Error reading from fragment file");
-        }
-        return;
+        // Fragment exhausted: terminate it and stop polling for writability
+        buffer[0] = '\0';
+        bytes_read = 1;
+        client->fragment_sent = 1;
+        update_client_events(epoll_fd, client);
     }
 
-    buffer[bytes_read] = '\0';
-    bytes_read += 1;
     int bytes_written;
     int total_bytes_written = 0;
 
     while (total_bytes_written < bytes_read ) {
         #ifdef DEBUG 
-            printf("Writing to client: %s\n", buffer + total_bytes_written);
+            printf("Writing to client: %.*s\n", bytes_read - total_bytes_written, buffer + total_bytes_written);
         #endif
         bytes_written = write(client->socket, buffer + total_bytes_written, bytes_read - total_bytes_written);
         if (bytes_written < 0) {
@@ -400,64 +938,494 @@ int read_fragment_data(FILE *fragment_file, char *buffer, int buffer_size) {
     return total_bytes_read;
 }
 
-void process_client_data(struct client_info *client, const char *data) {
-    char *data_copy = strdup(data);
-    char *token = strtok(data_copy, "\n");
-    
-    while (token) {
-        int line_number;
+// Parses the complete lines in data into the client's run and returns the
+// number of bytes consumed. A trailing partial line is left for the next
+// read unless this is the final block.
+size_t process_client_data(struct client_info *client, char *data, size_t length, int final) {
+    size_t consumed = 0;
+
+    while (consumed < length) {
+        char *line_start = data + consumed;
+        char *line_end = memchr(line_start, '\n', length - consumed);
+        if (!line_end) {
+            if (!final) {
+                break;
+            }
+            line_end = data + length;
+        }
+        size_t line_length = line_end - line_start;
+        consumed += line_length + (line_end < data + length ? 1 : 0);
+        if (line_length == 0) {
+            continue;
+        }
+        *line_end = '\0';
+
+        unsigned long long line_number;
         char *line;
-        parse_line(token, &line_number, &line);
+        size_t text_length;
+        parse_line(client, line_start, line_length, &line_number, &line, &text_length);
+        if (!line) {
+            continue;
+        }
+        if (output_stream && sort_key_is_line_order(&sort_key) && line_number < output_frontier) {
+            // Already streamed from a client that failed on the same fragment
+            release_text(client, line, text_length);
+            continue;
+        }
         #ifdef DEBUG
-            printf("Inserting line %d: %s\n", line_number, line);
+            printf("Inserting line %llu: %s\n", line_number, line);
         #endif
-        insert_line_node(line_number, line);
-        token = strtok(NULL, "\n");
+        if (client->run_length == client->run_capacity) {
+            size_t old_capacity = client->run_capacity;
+            client->run_capacity = client->run_capacity ? client->run_capacity * 2 : 1024;
+            client->run = (line_node **)realloc(client->run, client->run_capacity * sizeof(line_node *));
+            charge_bytes(client, (client->run_capacity - old_capacity) * sizeof(line_node *));
+        }
+        line_node *new_node = (line_node *)malloc(sizeof(line_node));
+        new_node->line_number = line_number;
+        new_node->line = line;
+        new_node->length = text_length;
+        new_node->key = sort_key_normalize(&sort_key, new_node);
+        client->run[client->run_length++] = new_node;
+        client->last_key = new_node->key;
+        charge_bytes(client, sizeof(line_node));
     }
-    
-    free(data_copy);
+
+    return consumed;
+}
+
+void finish_client_data(struct client_info *client) {
+    // Sort the client's run as a batch; runs are merged once, at the end
+    sort_line_nodes(&sort_key, client->run + client->run_consumed, client->run_length - client->run_consumed);
+    add_sorted_run(client->run, client->run_length, client->run_consumed, client->run_capacity * sizeof(line_node *));
+    release_dictionary(client);
+
+    // The run now counts only against the global budget
+    release_bytes(client, client->recv_capacity);
+    client->held_bytes = 0;
+    client->run_consumed = 0;
+    client->run = NULL;
+    client->run_length = 0;
+    client->run_capacity = 0;
+    free(client->recv_buffer);
+    client->recv_buffer = NULL;
+    client->recv_length = 0;
+    client->recv_capacity = 0;
+}
+
+// Frees the unstreamed lines of a client that failed partway, and rewinds
+// its fragment so another client can take it.
+void abandon_client_data(struct client_info *client) {
+    for (size_t i = client->run_consumed; i < client->run_length; i++) {
+        release_text(client, client->run[i]->line, client->run[i]->length);
+        free(client->run[i]);
+    }
+    release_dictionary(client);
+    release_bytes(client, client->held_bytes);
+    free(client->run);
+    client->run = NULL;
+    client->run_length = 0;
+    client->run_capacity = 0;
+    client->run_consumed = 0;
+    free(client->recv_buffer);
+    client->recv_buffer = NULL;
+    client->recv_length = 0;
+    client->recv_capacity = 0;
+
+    rewind(client->fragment_file);
+    client->fragment_file = NULL;
+    client->fragment = -1;
 }
-void parse_line(char *input, int *output_int, char **output_str) {
-    if (!input || !output_int || !output_str) {
+
+// Returns a copy of text for a new line, charged to the client. With
+// interning, repeated texts share one copy, charged to the server as a whole
+// since lines from different clients may share it.
+char *store_text(struct client_info *client, const char *text, size_t length) {
+    if (interning) {
+        int added;
+        char *shared = intern_text(&interned, text, length, &added);
+        if (added) {
+            charge_bytes(NULL, intern_entry_bytes(length));
+        }
+        return shared;
+    }
+    char *copy = (char *)malloc(length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    charge_bytes(client, length + 1);
+    return copy;
+}
+
+void release_text(struct client_info *client, char *text, size_t length) {
+    if (interning) {
+        if (intern_release(&interned, text)) {
+            release_bytes(NULL, intern_entry_bytes(length));
+        }
         return;
     }
-    sscanf(input, "%d", output_int);
-    const char *space = strchr(input, ' ');
-    if (space) {
-        *output_str = strdup(space + 1);
-    } else {
-        *output_str = strdup("");
+    free(text);
+    release_bytes(client, length + 1);
+}
+
+void release_dictionary(struct client_info *client) {
+    for (size_t i = 0; i < client->dictionary_length; i++) {
+        release_text(client, client->dictionary[i], client->dictionary_lengths[i]);
     }
+    release_bytes(client, client->dictionary_capacity * (sizeof(char *) + sizeof(size_t)));
+    free(client->dictionary);
+    free(client->dictionary_lengths);
+    client->dictionary = NULL;
+    client->dictionary_lengths = NULL;
+    client->dictionary_length = 0;
+    client->dictionary_capacity = 0;
 }
 
-void write_output(const char *output_file_name) {
-    FILE *output_file = fopen(output_file_name, "w");
-    if (!output_file) {
-        perror("Error opening output file");
+// Splits a received line into its number and a stored copy of its text.
+// "<n> <text>" is a plain line, "<n>+<text>" also defines the connection's
+// next back-reference, and "<n>*<id>" reuses the text of an earlier one.
+// The text is NULL for a back-reference that was never defined.
+void parse_line(struct client_info *client, char *input, size_t length, unsigned long long *output_number, char **output_str, size_t *output_length) {
+    if (!input || !output_number || !output_str || !output_length) {
         return;
     }
+    char *text_start;
+    *output_number = strtoull(input, &text_start, 10);
+    char marker = *text_start;
+    if (marker == ' ' || marker == '+' || marker == '*') {
+        text_start++;
+    }
 
-    line_node *current = get_head();
-    while (current) {
-        fprintf(output_file, "%s\n", current->line);
-        current = current->next;
+    if (marker == '*') {
+        unsigned long long id = strtoull(text_start, NULL, 10);
+        if (id >= client->dictionary_length) {
+            printf("Unknown back-reference %llu from client %d\n", id, client->socket);
+            *output_str = NULL;
+            return;
+        }
+        *output_length = client->dictionary_lengths[id];
+        *output_str = store_text(client, client->dictionary[id], *output_length);
+        return;
     }
 
-    fclose(output_file);
+    *output_length = length - (text_start - input);
+    if (marker == '+') {
+        if (client->dictionary_length == client->dictionary_capacity) {
+            size_t old_capacity = client->dictionary_capacity;
+            client->dictionary_capacity = client->dictionary_capacity ? client->dictionary_capacity * 2 : 256;
+            client->dictionary = (char **)realloc(client->dictionary, client->dictionary_capacity * sizeof(char *));
+            client->dictionary_lengths = (size_t *)realloc(client->dictionary_lengths,
+                                                           client->dictionary_capacity * sizeof(size_t));
+            charge_bytes(client, (client->dictionary_capacity - old_capacity) * (sizeof(char *) + sizeof(size_t)));
+        }
+        client->dictionary[client->dictionary_length] = store_text(client, text_start, *output_length);
+        client->dictionary_lengths[client->dictionary_length++] = *output_length;
+    }
+    *output_str = store_text(client, text_start, *output_length);
+}
+
+// Records a sorted run for the final merge, taking ownership of nodes and
+// of the charged bytes it holds against the global budget.
+void add_sorted_run(line_node **nodes, size_t length, size_t consumed, size_t charged) {
+    if (consumed == length) {
+        release_bytes(NULL, charged);
+        free(nodes);
+        return;
+    }
+    if (num_runs == runs_capacity) {
+        runs_capacity = runs_capacity ? runs_capacity * 2 : 16;
+        runs = (sorted_run *)realloc(runs, runs_capacity * sizeof(sorted_run));
+    }
+    runs[num_runs].nodes = nodes;
+    runs[num_runs].length = length;
+    runs[num_runs].consumed = consumed;
+    runs[num_runs].charged = charged;
+    num_runs++;
+}
+
+static int compare_node_pointers(const void *a, const void *b) {
+    return compare_line_nodes(&sort_key, *(line_node * const *)a, *(line_node * const *)b);
+}
+
+// First index in [low, high) of the run whose node is not below splitter.
+static size_t lower_bound_in_run(const sorted_run *run, size_t low, size_t high, const line_node *splitter) {
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compare_line_nodes(&sort_key, run->nodes[middle], splitter) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static int cursor_less(const merge_cursor *a, const merge_cursor *b) {
+    return compare_line_nodes(&sort_key, *a->next, *b->next) < 0;
+}
+
+static void sift_down(merge_cursor *heap, size_t size, size_t index) {
+    for (;;) {
+        size_t smallest = index;
+        size_t left = 2 * index + 1, right = left + 1;
+        if (left < size && cursor_less(&heap[left], &heap[smallest])) {
+            smallest = left;
+        }
+        if (right < size && cursor_less(&heap[right], &heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        merge_cursor swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+static int flush_slice_buffer(output_slice *slice, const char *buffer, size_t *buffered) {
+    size_t written = 0;
+    while (written < *buffered) {
+        ssize_t result = pwrite(slice->fd, buffer + written, *buffered - written, slice->offset);
+        if (result < 0) {
+            perror("Error writing output file");
+            return -1;
+        }
+        written += result;
+        slice->offset += result;
+    }
+    *buffered = 0;
+    return 0;
+}
+
+// Phase one: the formatted size of a slice, so offsets can be laid out.
+static void *measure_slice(void *argument) {
+    output_slice *slice = (output_slice *)argument;
+    slice->bytes = 0;
+    for (size_t r = 0; r < num_runs; r++) {
+        for (size_t i = slice->begin[r]; i < slice->end[r]; i++) {
+            slice->bytes += runs[r].nodes[i]->length + 1;
+        }
+    }
+    return NULL;
+}
+
+// Phase two: k-way merge the slice and pwrite it at its own offset.
+static void *write_slice(void *argument) {
+    output_slice *slice = (output_slice *)argument;
+    merge_cursor *heap = (merge_cursor *)malloc(sizeof(merge_cursor) * (num_runs ? num_runs : 1));
+    size_t heap_size = 0;
+    for (size_t r = 0; r < num_runs; r++) {
+        if (slice->begin[r] < slice->end[r]) {
+            heap[heap_size].next = runs[r].nodes + slice->begin[r];
+            heap[heap_size].end = runs[r].nodes + slice->end[r];
+            heap_size++;
+        }
+    }
+    for (size_t i = heap_size; i-- > 0; ) {
+        sift_down(heap, heap_size, i);
+    }
+
+    char *buffer = (char *)malloc(OUTPUT_CHUNK_SIZE);
+    size_t buffered = 0;
+    slice->status = 0;
+    line_checksum_init(&slice->checksum);
+
+    while (heap_size > 0 && slice->status == 0) {
+        line_node *node = *heap[0].next++;
+        if (heap[0].next == heap[0].end) {
+            heap[0] = heap[--heap_size];
+        }
+        sift_down(heap, heap_size, 0);
+
+        // A failed flush leaves the buffer full, so stop before adding to it
+        if (buffered + node->length + 1 > OUTPUT_CHUNK_SIZE) {
+            slice->status = flush_slice_buffer(slice, buffer, &buffered);
+            if (slice->status != 0) {
+                break;
+            }
+        }
+        if (node->length + 1 > OUTPUT_CHUNK_SIZE) {
+            // Longer than a chunk: write straight from the node
+            size_t line_bytes = node->length;
+            slice->status = flush_slice_buffer(slice, node->line, &line_bytes);
+            if (slice->status != 0) {
+                break;
+            }
+            buffer[buffered++] = '\n';
+        } else {
+            memcpy(buffer + buffered, node->line, node->length);
+            buffered += node->length;
+            buffer[buffered++] = '\n';
+        }
+        if (verifying) {
+            line_checksum_add(&slice->checksum, node->line, node->length);
+        }
+    }
+    if (slice->status == 0) {
+        slice->status = flush_slice_buffer(slice, buffer, &buffered);
+    }
+
+    free(buffer);
+    free(heap);
+    return NULL;
+}
+
+// Merges the remaining runs in parallel and writes them after whatever was
+// streamed during transfer. The key range is cut at splitters sampled from
+// every run; each thread merges its range from all runs and writes it with
+// pwrite at an offset laid out from the per-range formatted sizes.
+// Returns 0 once every range is written.
+int write_output(const char *output_file_name) {
+    int fd = open(output_file_name, O_WRONLY);
+    if (fd < 0) {
+        perror("Error opening output file");
+        return -1;
+    }
+    off_t base = lseek(fd, 0, SEEK_END);
+
+    // Lines inserted one at a time form one more sorted run
+    if (head) {
+        size_t count = 0;
+        for (line_node *current = head; current; current = current->next) {
+            count++;
+        }
+        line_node **nodes = (line_node **)malloc(count * sizeof(line_node *));
+        count = 0;
+        for (line_node *current = head; current; current = current->next) {
+            nodes[count++] = current;
+        }
+        add_sorted_run(nodes, count, 0, 0);
+        head = NULL;
+    }
+
+    size_t total_lines = 0;
+    for (size_t r = 0; r < num_runs; r++) {
+        total_lines += runs[r].length - runs[r].consumed;
+    }
+    int threads = output_threads;
+    if ((size_t)threads > total_lines / MIN_LINES_PER_THREAD) {
+        threads = total_lines / MIN_LINES_PER_THREAD;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    // Evenly spaced samples from every run give the range splitters
+    size_t samples_per_run = (size_t)threads * SPLITTER_OVERSAMPLING;
+    line_node **samples = (line_node **)malloc(sizeof(line_node *) * (num_runs * samples_per_run + 1));
+    size_t num_samples = 0;
+    for (size_t r = 0; r < num_runs && threads > 1; r++) {
+        size_t remaining = runs[r].length - runs[r].consumed;
+        for (size_t s = 0; s < samples_per_run && s < remaining; s++) {
+            samples[num_samples++] = runs[r].nodes[runs[r].consumed + s * remaining / samples_per_run];
+        }
+    }
+    qsort(samples, num_samples, sizeof(line_node *), compare_node_pointers);
+
+    output_slice *slices = (output_slice *)calloc(threads, sizeof(output_slice));
+    for (int t = 0; t < threads; t++) {
+        slices[t].begin = (size_t *)malloc(sizeof(size_t) * (num_runs ? num_runs : 1));
+        slices[t].end = (size_t *)malloc(sizeof(size_t) * (num_runs ? num_runs : 1));
+        slices[t].fd = fd;
+        for (size_t r = 0; r < num_runs; r++) {
+            slices[t].begin[r] = t == 0 ? runs[r].consumed : slices[t - 1].end[r];
+            if (t == threads - 1) {
+                slices[t].end[r] = runs[r].length;
+            } else {
+                line_node *splitter = samples[(t + 1) * num_samples / threads];
+                slices[t].end[r] = lower_bound_in_run(&runs[r], slices[t].begin[r], runs[r].length, splitter);
+            }
+        }
+    }
+    free(samples);
+
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, measure_slice, &slices[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    off_t offset = base;
+    for (int t = 0; t < threads; t++) {
+        slices[t].offset = offset;
+        offset += slices[t].bytes;
+    }
+    if (ftruncate(fd, offset) < 0) {
+        perror("Error sizing output file");
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, write_slice, &slices[t]);
+    }
+    int status = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+        line_checksum_append(&output_checksum, &slices[t].checksum);
+        if (slices[t].status != 0) {
+            status = -1;
+        }
+        free(slices[t].begin);
+        free(slices[t].end);
+    }
+    if (close(fd) != 0) {
+        perror("Error closing output file");
+        status = -1;
+    }
+
+    if (status == 0) {
+        printf("Wrote %zu lines with %d threads\n", total_lines, threads);
+    }
+    free(workers);
+    free(slices);
+    return status;
+}
+
+// Compares the checksum of the output as written against the one recorded
+// for the input. Order is only checked when the output is in line order.
+// Returns 0 on a match, and never when a write to the output failed.
+int verify_output(const char *checksum_filename) {
+    if (output_failed) {
+        printf("Output not verified: writing the output file failed\n");
+        return -1;
+    }
+
+    line_checksum expected;
+    if (line_checksum_read(checksum_filename, &expected) != 0) {
+        perror("Error reading checksum file");
+        return -1;
+    }
+
+    int ordered = sort_key_is_line_order(&sort_key);
+    int match = output_checksum.lines == expected.lines && output_checksum.sum == expected.sum &&
+                (!ordered || output_checksum.ordered == expected.ordered);
+    if (match) {
+        printf("Output verified: %llu lines, checksum %llx%s\n", output_checksum.lines,
+               ordered ? output_checksum.ordered : output_checksum.sum, ordered ? "" : " (order not checked)");
+        return 0;
+    }
+    printf("Output checksum mismatch: %llu lines, checksum %llx %llx; expected %llu lines, %llx %llx\n",
+           output_checksum.lines, output_checksum.ordered, output_checksum.sum,
+           expected.lines, expected.ordered, expected.sum);
+    return -1;
 }
 
-void insert_line_node(int line_number, const char *line) {
+void insert_line_node(unsigned long long line_number, const char *line) {
     line_node *new_node = (line_node *)malloc(sizeof(line_node));
     new_node->line_number = line_number;
-    new_node->line = strdup(line);
+    new_node->length = strlen(line);
+    new_node->line = store_text(NULL, line, new_node->length);
+    new_node->key = sort_key_normalize(&sort_key, new_node);
     new_node->next = NULL;
 
-    if (!head || line_number < head->line_number) {
+    if (!head || compare_line_nodes(&sort_key, new_node, head) < 0) {
         new_node->next = head;
         head = new_node;
     } else {
         line_node *current = head;
-        while (current->next && current->next->line_number < line_number) {
+        while (current->next && compare_line_nodes(&sort_key, current->next, new_node) < 0) {
             current = current->next;
         }
         new_node->next = current->next;
@@ -473,7 +1441,7 @@ void free_line_nodes() {
     line_node *current = head;
     while (current) {
         line_node *next = current->next;
-        free(current->line);
+        release_text(NULL, current->line, current->length);
         free(current);
         current = next;
     }
@@ -0,0 +1,426 @@
+// sort_key.h: pluggable sort keys for line_node records.
+//
+// A key is a comma-separated list of components, compared left to right,
+// with the line number as the final tie-break:
+//
+//     line        the leading line number (default, reassembles the input)
+//     field:N     unsigned integer at the start of whitespace field N (1-based)
+//     column:N    whitespace field N, compared byte-wise
+//     prefix:W    first W bytes of the text, compared byte-wise
+//     text        the whole text, compared byte-wise
+//
+// Sorting never calls a generic comparator: integer components are sorted
+// with an LSD radix pass over their value, byte components with an MSD radix
+// over 8-byte big-endian normalized chunks. Multi-component keys apply one
+// stable pass per component, last to first.
+
+#ifndef SORT_KEY_H
+#define SORT_KEY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "line_node.h"
+
+#define SORT_KEY_MAX_COMPONENTS 8
+#define SORT_KEY_CHUNK_SIZE 8
+
+typedef enum sort_key_kind {
+    SORT_KEY_LINE_NUMBER,
+    SORT_KEY_FIELD,
+    SORT_KEY_COLUMN,
+    SORT_KEY_PREFIX,
+    SORT_KEY_TEXT
+} sort_key_kind;
+
+typedef struct sort_key_component {
+    sort_key_kind kind;
+    size_t argument;            // field index or prefix width
+} sort_key_component;
+
+typedef struct sort_key_spec {
+    int num_components;
+    sort_key_component components[SORT_KEY_MAX_COMPONENTS];
+} sort_key_spec;
+
+// Bytes of one node's key component, located once per byte-wise pass.
+typedef struct sort_key_span {
+    const char *start;
+    size_t length;
+} sort_key_span;
+
+// Nodes [begin, begin + count) share every key chunk before offset.
+typedef struct sort_key_range {
+    size_t begin;
+    size_t count;
+    size_t offset;
+} sort_key_range;
+
+static inline int sort_key_is_numeric(const sort_key_component *component) {
+    return component->kind == SORT_KEY_LINE_NUMBER || component->kind == SORT_KEY_FIELD;
+}
+
+// Returns 0 on success, -1 if the spec string is malformed.
+static inline int parse_sort_key_spec(const char *text, sort_key_spec *spec) {
+    spec->num_components = 0;
+    const char *cursor = text;
+
+    while (*cursor) {
+        if (spec->num_components == SORT_KEY_MAX_COMPONENTS) {
+            return -1;
+        }
+        sort_key_component *component = &spec->components[spec->num_components];
+        size_t name_length = strcspn(cursor, ":,");
+        int needs_argument = 1;
+
+        if (name_length == 4 && strncmp(cursor, "line", 4) == 0) {
+            component->kind = SORT_KEY_LINE_NUMBER;
+            needs_argument = 0;
+        } else if (name_length == 4 && strncmp(cursor, "text", 4) == 0) {
+            component->kind = SORT_KEY_TEXT;
+            needs_argument = 0;
+        } else if (name_length == 5 && strncmp(cursor, "field", 5) == 0) {
+            component->kind = SORT_KEY_FIELD;
+        } else if (name_length == 6 && strncmp(cursor, "column", 6) == 0) {
+            component->kind = SORT_KEY_COLUMN;
+        } else if (name_length == 6 && strncmp(cursor, "prefix", 6) == 0) {
+            component->kind = SORT_KEY_PREFIX;
+        } else {
+            return -1;
+        }
+        cursor += name_length;
+
+        component->argument = 0;
+        if (needs_argument) {
+            if (*cursor != ':') {
+                return -1;
+            }
+            char *end;
+            component->argument = strtoul(cursor + 1, &end, 10);
+            if (end == cursor + 1 || component->argument == 0) {
+                return -1;
+            }
+            cursor = end;
+        } else if (*cursor == ':') {
+            return -1;
+        }
+
+        spec->num_components++;
+        if (*cursor == ',') {
+            cursor++;
+            if (!*cursor) {
+                return -1;
+            }
+        } else if (*cursor) {
+            return -1;
+        }
+    }
+
+    return spec->num_components > 0 ? 0 : -1;
+}
+
+static inline void default_sort_key_spec(sort_key_spec *spec) {
+    spec->num_components = 1;
+    spec->components[0].kind = SORT_KEY_LINE_NUMBER;
+    spec->components[0].argument = 0;
+}
+
+static inline int sort_key_is_line_order(const sort_key_spec *spec) {
+    return spec->components[0].kind == SORT_KEY_LINE_NUMBER;
+}
+
+// Locates whitespace-separated field `index` (1-based); empty if absent.
+static inline void sort_key_find_field(const char *text, size_t length, size_t index,
+                                       const char **start, size_t *field_length) {
+    size_t pos = 0;
+    for (size_t field = 1; ; field++) {
+        while (pos < length && (text[pos] == ' ' || text[pos] == '\t')) {
+            pos++;
+        }
+        size_t end = pos;
+        while (end < length && text[end] != ' ' && text[end] != '\t') {
+            end++;
+        }
+        if (field == index || pos == length) {
+            *start = text + pos;
+            *field_length = end - pos;
+            return;
+        }
+        pos = end;
+    }
+}
+
+static inline unsigned long long sort_key_number(const sort_key_component *component, const line_node *node) {
+    if (component->kind == SORT_KEY_LINE_NUMBER) {
+        return node->line_number;
+    }
+
+    const char *start;
+    size_t length;
+    sort_key_find_field(node->line, node->length, component->argument, &start, &length);
+    unsigned long long value = 0;
+    for (size_t i = 0; i < length && start[i] >= '0' && start[i] <= '9'; i++) {
+        value = value * 10 + (unsigned long long)(start[i] - '0');
+    }
+    return value;
+}
+
+static inline void sort_key_bytes(const sort_key_component *component, const line_node *node,
+                                  const char **start, size_t *length) {
+    switch (component->kind) {
+    case SORT_KEY_COLUMN:
+        sort_key_find_field(node->line, node->length, component->argument, start, length);
+        break;
+    case SORT_KEY_PREFIX:
+        *start = node->line;
+        *length = node->length < component->argument ? node->length : component->argument;
+        break;
+    default:
+        *start = node->line;
+        *length = node->length;
+        break;
+    }
+}
+
+// Big-endian chunk of bytes [offset, offset + 8), zero padded. Lines never
+// contain NUL bytes, so equal chunks past the end of both inputs mean equal.
+static inline unsigned long long sort_key_chunk(const char *bytes, size_t length, size_t offset) {
+    unsigned long long chunk = 0;
+    for (size_t i = 0; i < SORT_KEY_CHUNK_SIZE; i++) {
+        chunk <<= 8;
+        if (offset + i < length) {
+            chunk |= (unsigned char)bytes[offset + i];
+        }
+    }
+    return chunk;
+}
+
+// Normalized value of the first key component, cached in line_node.key.
+static inline unsigned long long sort_key_normalize(const sort_key_spec *spec, const line_node *node) {
+    const sort_key_component *component = &spec->components[0];
+    if (sort_key_is_numeric(component)) {
+        return sort_key_number(component, node);
+    }
+    const char *start;
+    size_t length;
+    sort_key_bytes(component, node, &start, &length);
+    return sort_key_chunk(start, length, 0);
+}
+
+static inline int compare_line_nodes(const sort_key_spec *spec, const line_node *a, const line_node *b) {
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+
+    for (int i = 0; i < spec->num_components; i++) {
+        const sort_key_component *component = &spec->components[i];
+        if (sort_key_is_numeric(component)) {
+            unsigned long long value_a = sort_key_number(component, a);
+            unsigned long long value_b = sort_key_number(component, b);
+            if (value_a != value_b) {
+                return value_a < value_b ? -1 : 1;
+            }
+        } else {
+            const char *start_a, *start_b;
+            size_t length_a, length_b;
+            sort_key_bytes(component, a, &start_a, &length_a);
+            sort_key_bytes(component, b, &start_b, &length_b);
+            int result = memcmp(start_a, start_b, length_a < length_b ? length_a : length_b);
+            if (result != 0) {
+                return result;
+            }
+            if (length_a != length_b) {
+                return length_a < length_b ? -1 : 1;
+            }
+        }
+    }
+
+    if (a->line_number != b->line_number) {
+        return a->line_number < b->line_number ? -1 : 1;
+    }
+    return 0;
+}
+
+// Stable LSD radix sort of nodes by keys, one byte per pass. Passes where
+// every key shares the same byte are skipped, so small keys cost little.
+// spans, if not NULL, are moved along with their nodes.
+static inline void sort_key_radix(line_node **nodes, unsigned long long *keys,
+                                  line_node **node_scratch, unsigned long long *key_scratch,
+                                  sort_key_span *spans, sort_key_span *span_scratch, size_t count) {
+    line_node **node_from = nodes, **node_to = node_scratch;
+    unsigned long long *key_from = keys, *key_to = key_scratch;
+    sort_key_span *span_from = spans, *span_to = span_scratch;
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            offsets[(key_from[i] >> shift) & 0xff]++;
+        }
+        if (offsets[(key_from[0] >> shift) & 0xff] == count) {
+            continue;
+        }
+
+        size_t total = 0;
+        for (int bucket = 0; bucket < 256; bucket++) {
+            size_t bucket_count = offsets[bucket];
+            offsets[bucket] = total;
+            total += bucket_count;
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t dest = offsets[(key_from[i] >> shift) & 0xff]++;
+            node_to[dest] = node_from[i];
+            key_to[dest] = key_from[i];
+            if (spans) {
+                span_to[dest] = span_from[i];
+            }
+        }
+
+        line_node **node_swap = node_from;
+        node_from = node_to;
+        node_to = node_swap;
+        unsigned long long *key_swap = key_from;
+        key_from = key_to;
+        key_to = key_swap;
+        sort_key_span *span_swap = span_from;
+        span_from = span_to;
+        span_to = span_swap;
+    }
+
+    if (node_from != nodes) {
+        memcpy(nodes, node_from, count * sizeof(line_node *));
+        memcpy(keys, key_from, count * sizeof(unsigned long long));
+        if (spans) {
+            memcpy(spans, span_from, count * sizeof(sort_key_span));
+        }
+    }
+}
+
+// MSD radix sort over 8-byte chunks of a byte-wise component. Ranges that
+// still share a chunk are kept on an explicit stack rather than recursed
+// into, and a range whose nodes all share a chunk just moves to the next
+// one, so lines with long common prefixes cost no stack depth.
+static inline void sort_key_sort_bytes(const sort_key_component *component, line_node **nodes,
+                                       unsigned long long *keys, line_node **node_scratch,
+                                       unsigned long long *key_scratch, size_t count) {
+    sort_key_span *spans = (sort_key_span *)malloc(count * sizeof(sort_key_span));
+    sort_key_span *span_scratch = (sort_key_span *)malloc(count * sizeof(sort_key_span));
+    // Pending ranges are disjoint and hold at least two nodes each
+    sort_key_range *stack = (sort_key_range *)malloc((count / 2 + 1) * sizeof(sort_key_range));
+    size_t stack_size = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        sort_key_bytes(component, nodes[i], &spans[i].start, &spans[i].length);
+    }
+    stack[stack_size].begin = 0;
+    stack[stack_size].count = count;
+    stack[stack_size].offset = 0;
+    stack_size++;
+
+    while (stack_size > 0) {
+        sort_key_range range = stack[--stack_size];
+        line_node **range_nodes = nodes + range.begin;
+        unsigned long long *range_keys = keys + range.begin;
+        sort_key_span *range_spans = spans + range.begin;
+
+        for (;;) {
+            int remaining = 0;
+            for (size_t i = 0; i < range.count; i++) {
+                range_keys[i] = sort_key_chunk(range_spans[i].start, range_spans[i].length, range.offset);
+                if (range_spans[i].length > range.offset + SORT_KEY_CHUNK_SIZE) {
+                    remaining = 1;
+                }
+            }
+            sort_key_radix(range_nodes, range_keys, node_scratch, key_scratch, range_spans, span_scratch,
+                           range.count);
+            if (!remaining) {
+                break;
+            }
+            if (range_keys[0] == range_keys[range.count - 1]) {
+                range.offset += SORT_KEY_CHUNK_SIZE;
+                continue;
+            }
+
+            // Runs sharing this chunk are ordered by the next one
+            size_t run_start = 0;
+            for (size_t i = 1; i <= range.count; i++) {
+                if (i == range.count || range_keys[i] != range_keys[run_start]) {
+                    if (i - run_start > 1) {
+                        stack[stack_size].begin = range.begin + run_start;
+                        stack[stack_size].count = i - run_start;
+                        stack[stack_size].offset = range.offset + SORT_KEY_CHUNK_SIZE;
+                        stack_size++;
+                    }
+                    run_start = i;
+                }
+            }
+            break;
+        }
+    }
+
+    free(stack);
+    free(span_scratch);
+    free(spans);
+}
+
+// Sorts nodes in place, links them through next and returns the new head.
+static inline line_node *sort_line_nodes(const sort_key_spec *spec, line_node **nodes, size_t count) {
+    if (count == 0) {
+        return NULL;
+    }
+
+    unsigned long long *keys = (unsigned long long *)malloc(count * sizeof(unsigned long long));
+    unsigned long long *key_scratch = (unsigned long long *)malloc(count * sizeof(unsigned long long));
+    line_node **node_scratch = (line_node **)malloc(count * sizeof(line_node *));
+
+    sort_key_component line_order = { SORT_KEY_LINE_NUMBER, 0 };
+    const sort_key_component *last = &spec->components[spec->num_components - 1];
+    if (last->kind != SORT_KEY_LINE_NUMBER) {
+        // Final tie-break first; every later pass is stable
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = sort_key_number(&line_order, nodes[i]);
+        }
+        sort_key_radix(nodes, keys, node_scratch, key_scratch, NULL, NULL, count);
+    }
+
+    for (int c = spec->num_components - 1; c >= 0; c--) {
+        const sort_key_component *component = &spec->components[c];
+        if (sort_key_is_numeric(component)) {
+            for (size_t i = 0; i < count; i++) {
+                keys[i] = sort_key_number(component, nodes[i]);
+            }
+            sort_key_radix(nodes, keys, node_scratch, key_scratch, NULL, NULL, count);
+        } else {
+            sort_key_sort_bytes(component, nodes, keys, node_scratch, key_scratch, count);
+        }
+    }
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        nodes[i]->next = nodes[i + 1];
+    }
+    nodes[count - 1]->next = NULL;
+
+    free(keys);
+    free(key_scratch);
+    free(node_scratch);
+    return nodes[0];
+}
+
+// Merges two sorted lists into one.
+static inline line_node *merge_line_nodes(const sort_key_spec *spec, line_node *a, line_node *b) {
+    line_node merged;
+    line_node *tail = &merged;
+
+    while (a && b) {
+        if (compare_line_nodes(spec, b, a) < 0) {
+            tail->next = b;
+            b = b->next;
+        } else {
+            tail->next = a;
+            a = a->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return merged.next;
+}
+
+#endif